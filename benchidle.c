@@ -0,0 +1,165 @@
+/**********************************************************************
+ *
+ * benchidle.c - bytes held per idle connection
+ *
+ * builds against inetcode.c and its dependencies:
+ *   cc -O2 -o benchidle benchidle.c imembase.c imemdata.c \
+ *         inetbase.c inetcode.c -lpthread
+ *
+ * usage: benchidle [pairs]
+ *
+ * each socketpair is assigned to one core with ITMH_LINESPLIT, every
+ * line is sent in two halves so it goes through the partial line
+ * buffer, then the connections go idle. ikmem is hooked to count the
+ * bytes held and the allocations made per line, pages cached by the
+ * core after the connections are closed are not counted as theirs.
+ *
+ **********************************************************************/
+#include "inetcode.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_LINES		16
+
+
+/*-------------------------------------------------------------------*/
+/* counting allocator                                                */
+/*-------------------------------------------------------------------*/
+static long bench_bytes = 0;
+static long bench_calls = 0;
+
+static void *bench_malloc(size_t size)
+{
+	size_t *ptr = (size_t*)malloc(size + sizeof(size_t) * 2);
+	if (ptr == NULL) return NULL;
+	ptr[0] = size;
+	bench_bytes += (long)size;
+	bench_calls++;
+	return ptr + 2;
+}
+
+static void bench_free(void *mem)
+{
+	size_t *ptr = (size_t*)mem - 2;
+	if (mem == NULL) return;
+	bench_bytes -= (long)ptr[0];
+	free(ptr);
+}
+
+static size_t bench_ptr_size(const void *mem)
+{
+	return ((const size_t*)mem)[-2];
+}
+
+static void *bench_realloc(void *mem, size_t size)
+{
+	void *ptr = bench_malloc(size);
+	if (ptr == NULL || mem == NULL) return ptr;
+	if (bench_ptr_size(mem) < size) size = bench_ptr_size(mem);
+	memcpy(ptr, mem, size);
+	bench_free(mem);
+	return ptr;
+}
+
+static void bench_shrink(void)
+{
+}
+
+static const ikmemhook_t bench_hook = {
+	bench_malloc, bench_free, bench_realloc, bench_ptr_size, bench_shrink
+};
+
+
+/*-------------------------------------------------------------------*/
+/* run the core a few rounds and until count DATA events arrived     */
+/*-------------------------------------------------------------------*/
+static long bench_pump(CAsyncCore *core, long count)
+{
+	static char data[0x10000];
+	long wparam, lparam, got = 0;
+	int event, loops;
+	for (loops = 0; loops < 1000; loops++) {
+		async_core_wait(core, 1);
+		while (async_core_read(core, &event, &wparam, &lparam, 
+			data, sizeof(data)) >= 0) {
+			if (event == ASYNC_CORE_EVT_DATA) got++;
+		}
+		if (got >= count && loops >= 4) break;
+	}
+	return got;
+}
+
+
+/*-------------------------------------------------------------------*/
+/* main                                                              */
+/*-------------------------------------------------------------------*/
+int main(int argc, char *argv[])
+{
+	long pairs = (argc > 1)? atol(argv[1]) : 1000;
+	long base, fresh, idle, closed, calls, got = 0, i, j;
+	CAsyncCore *core;
+	long *hids;
+
+	ikmem_hook_install(&bench_hook);
+	core = async_core_new(0);
+	hids = (long*)malloc(sizeof(long) * pairs * 2);
+	if (core == NULL || hids == NULL) return 1;
+
+	bench_pump(core, 0);
+	base = bench_bytes;
+
+	for (i = 0; i < pairs; i++) {
+		int fds[2];
+		if (inet_socketpair(fds) != 0) {
+			printf("socketpair failed after %ld pairs\n", i);
+			return 2;
+		}
+		hids[i * 2 + 0] = async_core_new_assign(core, fds[0], 
+			ITMH_LINESPLIT, 1);
+		hids[i * 2 + 1] = async_core_new_assign(core, fds[1], 
+			ITMH_LINESPLIT, 1);
+	}
+
+	bench_pump(core, 0);
+	fresh = bench_bytes - base;
+	calls = bench_calls;
+
+	for (j = 0; j < BENCH_LINES; j++) {
+		for (i = 0; i < pairs; i++) {
+			async_core_send(core, hids[i * 2], "hello, ", 7);
+		}
+		bench_pump(core, 0);
+		for (i = 0; i < pairs; i++) {
+			async_core_send(core, hids[i * 2], "world\n", 6);
+		}
+		got += bench_pump(core, pairs);
+	}
+
+	bench_pump(core, 0);
+	idle = bench_bytes - base;
+	calls = bench_calls - calls;
+
+	for (i = 0; i < pairs * 2; i++) {
+		async_core_close(core, hids[i], 0);
+	}
+
+	bench_pump(core, 0);
+	closed = bench_bytes - base;
+
+	printf("connections: %ld, lines: %ld/%ld\n", pairs * 2, got, 
+		pairs * BENCH_LINES);
+	printf("fresh: %ld bytes per connection\n", fresh / (pairs * 2));
+	printf("idle: %ld bytes per connection kept after traffic\n", 
+		(idle - closed) / (pairs * 2));
+	printf("cached by the core: %ld bytes\n", closed);
+	printf("ikmem_malloc: %.2f calls per line\n", 
+		(double)calls / (double)(pairs * BENCH_LINES));
+
+	async_core_delete(core);
+	free(hids);
+
+	return 0;
+}
+
@@ -0,0 +1,161 @@
+/**********************************************************************
+ *
+ * benchqueue.c - iQueueSafe throughput, mutex queue against ring
+ *
+ * builds against inetcode.c and its dependencies:
+ *   cc -O2 -o benchqueue benchqueue.c imembase.c imemdata.c \
+ *         inetbase.c inetcode.c -lpthread
+ *
+ * usage: benchqueue [items] [batch]
+ *
+ * for 1x1, 2x2 and 4x4 producers x consumers, every producer puts
+ * `items` pointers in vectors of `batch`, consumers take vectors of
+ * the same size. prints million items per second for queue_safe_new
+ * and queue_safe_new_ring, and checks that every item arrived once.
+ *
+ **********************************************************************/
+#include "inetcode.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define BENCH_BATCH_MAX		64
+#define BENCH_THREADS		8
+
+struct BenchPeer
+{
+	iQueueSafe *queue;
+	long id;
+	long items;
+	int batch;
+	IINT64 sum;
+	long count;
+};
+
+
+/*-------------------------------------------------------------------*/
+/* producer: puts id * items + 1 ... id * items + items              */
+/*-------------------------------------------------------------------*/
+static int bench_producer(void *obj)
+{
+	struct BenchPeer *peer = (struct BenchPeer*)obj;
+	void *vec[BENCH_BATCH_MAX];
+	long i = 0;
+	while (i < peer->items) {
+		long n = peer->items - i;
+		int k = 0;
+		if (n > peer->batch) n = peer->batch;
+		for (k = 0; k < n; k++) {
+			vec[k] = (void*)(size_t)(peer->id * peer->items + i + k + 1);
+		}
+		for (k = 0; k < n; ) {
+			k += queue_safe_put_vec(peer->queue, 
+				(const void * const *)vec + k, (int)n - k, 
+				IEVENT_INFINITE);
+		}
+		i += n;
+	}
+	return 0;
+}
+
+
+/*-------------------------------------------------------------------*/
+/* consumer: sums items until it takes a NULL, extra NULLs go back   */
+/*-------------------------------------------------------------------*/
+static int bench_consumer(void *obj)
+{
+	struct BenchPeer *peer = (struct BenchPeer*)obj;
+	void *vec[BENCH_BATCH_MAX];
+	while (1) {
+		int n = queue_safe_get_vec(peer->queue, vec, peer->batch, 
+			IEVENT_INFINITE);
+		int nulls = 0, k;
+		for (k = 0; k < n; k++) {
+			if (vec[k] == NULL) {
+				nulls++;
+			}	else {
+				peer->sum += (IINT64)(size_t)vec[k];
+				peer->count++;
+			}
+		}
+		if (nulls > 0) {
+			for (k = 1; k < nulls; k++) {
+				queue_safe_put(peer->queue, NULL, IEVENT_INFINITE);
+			}
+			break;
+		}
+	}
+	return 0;
+}
+
+
+/*-------------------------------------------------------------------*/
+/* one configuration, returns million items per second or -1         */
+/*-------------------------------------------------------------------*/
+static double bench_queue(int ring, int np, int nc, long items, int batch)
+{
+	struct BenchPeer peers[BENCH_THREADS * 2];
+	iPosixThread *threads[BENCH_THREADS * 2];
+	IINT64 ts, sum = 0, expect = 0, total = (IINT64)np * items;
+	long count = 0;
+	iQueueSafe *queue;
+	int i;
+	queue = ring? queue_safe_new_ring(1024) : queue_safe_new(1024);
+	if (queue == NULL) return -1;
+	for (i = 0; i < np + nc; i++) {
+		peers[i].queue = queue;
+		peers[i].id = (i < np)? i : 0;
+		peers[i].items = items;
+		peers[i].batch = batch;
+		peers[i].sum = 0;
+		peers[i].count = 0;
+	}
+	ts = iclock64();
+	for (i = 0; i < np + nc; i++) {
+		threads[i] = iposix_thread_new((i < np)? bench_producer : 
+			bench_consumer, &peers[i], "bench");
+		iposix_thread_start(threads[i]);
+	}
+	for (i = 0; i < np; i++) {
+		iposix_thread_join(threads[i], IEVENT_INFINITE);
+	}
+	for (i = 0; i < nc; i++) {
+		queue_safe_put(queue, NULL, IEVENT_INFINITE);
+	}
+	for (i = np; i < np + nc; i++) {
+		iposix_thread_join(threads[i], IEVENT_INFINITE);
+		sum += peers[i].sum;
+		count += peers[i].count;
+	}
+	ts = iclock64() - ts;
+	for (i = 0; i < np + nc; i++) {
+		iposix_thread_delete(threads[i]);
+	}
+	queue_safe_delete(queue);
+	expect = total * (total + 1) / 2;
+	if (count != total || sum != expect) return -1;
+	return (double)total / 1000.0 / (double)(ts + 1);
+}
+
+
+/*-------------------------------------------------------------------*/
+/* main                                                              */
+/*-------------------------------------------------------------------*/
+int main(int argc, char *argv[])
+{
+	static const int config[3] = { 1, 2, 4 };
+	long items = (argc > 1)? atol(argv[1]) : 1000000;
+	int batch = (argc > 2)? atoi(argv[2]) : 1;
+	int i;
+	if (batch < 1) batch = 1;
+	if (batch > BENCH_BATCH_MAX) batch = BENCH_BATCH_MAX;
+	printf("items=%ld per producer, batch=%d\n", items, batch);
+	for (i = 0; i < 3; i++) {
+		int n = config[i];
+		double a = bench_queue(0, n, n, items, batch);
+		double b = bench_queue(1, n, n, items, batch);
+		printf("%dx%d: mutex %.2f M/s, ring %.2f M/s\n", n, n, a, b);
+	}
+	return 0;
+}
+
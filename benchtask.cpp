@@ -0,0 +1,87 @@
+/**********************************************************************
+ *
+ * benchtask.cpp - TaskPool throughput against the number of threads
+ *
+ * builds against system.h and the C sources it depends on:
+ *   c++ -O2 -o benchtask benchtask.cpp imembase.c imemdata.c \
+ *         inetbase.c inetcode.c inetnot.c ineturl.c iposix.c \
+ *         itoolbox.c -lpthread
+ *
+ * usage: benchtask [tasks] [work] [threads ...]
+ *
+ * pushes tasks from the main thread, calling update() every 1024
+ * pushes, each task spins `work` iterations in run(). prints tasks per
+ * second for every thread count (default: 1 2 4 8).
+ *
+ **********************************************************************/
+#include "system.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace System;
+
+
+//---------------------------------------------------------------------
+// task: spins in the worker, counts completions in the main thread
+//---------------------------------------------------------------------
+struct BenchTask: public TaskInt
+{
+	BenchTask(int work, long *done): _work(work), _done(done) {}
+
+	virtual void run() {
+		volatile int sum = 0;
+		for (int i = 0; i < _work; i++) sum += i;
+	}
+
+	virtual void done() { _done[0]++; }
+	virtual void error() {}
+	virtual void final() {}
+
+	int _work;
+	long *_done;
+};
+
+
+//---------------------------------------------------------------------
+// run one pool size, returns tasks per second
+//---------------------------------------------------------------------
+static double bench_pool(int nthreads, long tasks, int work)
+{
+	TaskPool pool("bench", nthreads, 1);
+	long done = 0;
+	pool.start();
+	IINT64 ts = iclock64();
+	for (long i = 0; i < tasks; i++) {
+		pool.push(new BenchTask(work, &done));
+		if ((i & 1023) == 0) pool.update();
+	}
+	pool.wait();
+	IINT64 elapsed = iclock64() - ts;
+	pool.stop();
+	if (done != tasks) {
+		printf("error: %ld of %ld tasks done\n", done, tasks);
+		exit(1);
+	}
+	return (double)tasks * 1000.0 / (double)(elapsed + 1);
+}
+
+
+//---------------------------------------------------------------------
+// main
+//---------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+	static const int defaults[] = { 1, 2, 4, 8 };
+	long tasks = (argc > 1)? atol(argv[1]) : 1000000;
+	int work = (argc > 2)? atoi(argv[2]) : 100;
+	int count = (argc > 3)? argc - 3 : 4;
+	printf("tasks=%ld work=%d\n", tasks, work);
+	for (int i = 0; i < count; i++) {
+		int nthreads = (argc > 3)? atoi(argv[i + 3]) : defaults[i];
+		double rate = bench_pool(nthreads, tasks, work);
+		printf("threads=%d: %.0f tasks/s\n", nthreads, rate);
+	}
+	return 0;
+}
+
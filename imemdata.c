@@ -871,11 +871,22 @@ struct IMSPAGE
 	struct IQUEUEHEAD head;
 	iulong size;
 	iulong index;
+	IUINT8 *ptr;
+	struct IMSHARED *shared;
 	IUINT8 data[2];
 };
 
 #define IMSPAGE_LRU_SIZE	2
 
+#if defined(__GNUC__)
+#define IMS_ATOMIC_ADD(p, v)	__sync_add_and_fetch((p), (v))
+#elif defined(_WIN32)
+#define IMS_ATOMIC_ADD(p, v)	\
+	(InterlockedExchangeAdd((LONG volatile*)(p), (LONG)(v)) + (v))
+#else
+#define IMS_ATOMIC_ADD(p, v)	((*(p)) += (v))
+#endif
+
 /* init memory stream */
 void ims_init(struct IMSTREAM *s, imemnode_t *fnode, ilong low, ilong high)
 {
@@ -924,6 +935,8 @@ static struct IMSPAGE *ims_page_new(struct IMSTREAM *s)
 	}
 
 	iqueue_init(&page->head);
+	page->ptr = page->data;
+	page->shared = NULL;
 
 	return page;
 }
@@ -949,6 +962,11 @@ void ims_destroy(struct IMSTREAM *s)
 	for (; iqueue_is_empty(&s->head) == 0; ) {
 		current = iqueue_entry(s->head.next, struct IMSPAGE, head);
 		iqueue_del(&current->head);
+		if (current->shared) {
+			ims_shared_unref(current->shared);
+			ikmem_free(current);
+			continue;
+		}
 		ims_page_del(s, current);
 	}
 
@@ -990,6 +1008,16 @@ static struct IMSPAGE *ims_page_cache_get(struct IMSTREAM *s)
 /* give page back to lru cache */
 static void ims_page_cache_release(struct IMSTREAM *s, struct IMSPAGE *page)
 {
+	if (page->shared) {		/* link page: drop reference only */
+		ims_shared_unref(page->shared);
+		ikmem_free(page);
+		return;
+	}
+	if (s->fixed_pages != NULL) {
+		page->size = s->fixed_pages->node_size - sizeof(struct IMSPAGE);
+	}	else {
+		page->size = ikmem_ptr_size(page) - sizeof(struct IMSPAGE);
+	}
 	iqueue_add_tail(&page->head, &s->lru);
 	s->lrusize++;
 	for (; s->lrusize > (IMSPAGE_LRU_SIZE << 1); ) {
@@ -1067,7 +1095,7 @@ ilong ims_read_sub(struct IMSTREAM *s, void *ptr, ilong size, int nodrop)
 		toread = (size <= canread)? size : canread;
 		if (toread == 0) break;
 		if (lptr) {
-			memcpy(lptr, current->data + posread, toread);
+			memcpy(lptr, current->ptr + posread, toread);
 			lptr += toread;
 		}
 		posread += toread;
@@ -1117,6 +1145,37 @@ void ims_clear(struct IMSTREAM *s)
 	ims_drop(s, s->size);
 }
 
+/* release spare pages, and the drained tail page if stream is empty */
+void ims_trim(struct IMSTREAM *s)
+{
+	struct IMSPAGE *current;
+
+	assert(s);
+
+	if (s->size == 0) {
+		for (; iqueue_is_empty(&s->head) == 0; ) {
+			current = iqueue_entry(s->head.next, struct IMSPAGE, head);
+			iqueue_del(&current->head);
+			if (current->shared) {
+				ims_shared_unref(current->shared);
+				ikmem_free(current);
+				continue;
+			}
+			ims_page_del(s, current);
+		}
+		s->pos_read = 0;
+		s->pos_write = 0;
+	}
+
+	for (; iqueue_is_empty(&s->lru) == 0; ) {
+		current = iqueue_entry(s->lru.next, struct IMSPAGE, head);
+		iqueue_del(&current->head);
+		ims_page_del(s, current);
+	}
+
+	s->lrusize = 0;
+}
+
 /* get flat ptr and size */
 ilong ims_flat(const struct IMSTREAM *s, void **pointer)
 {
@@ -1126,7 +1185,7 @@ ilong ims_flat(const struct IMSTREAM *s, void **pointer)
 		return 0;
 	}
 	current = iqueue_entry(s->head.next, struct IMSPAGE, head);
-	if (pointer) pointer[0] = current->data + s->pos_read;
+	if (pointer) pointer[0] = current->ptr + s->pos_read;
 
 	if (current->head.next != &s->head) 
 		return current->size - s->pos_read;
@@ -1134,6 +1193,194 @@ ilong ims_flat(const struct IMSTREAM *s, void **pointer)
 	return s->pos_write - s->pos_read;
 }
 
+/* get flat ptrs and sizes of up to count pages */
+int ims_flatv(const struct IMSTREAM *s, void *pointers[], ilong sizes[],
+	int count)
+{
+	const struct IQUEUEHEAD *head;
+	struct IMSPAGE *current;
+	iulong pos = s->pos_read;
+	int n = 0;
+	if (s->size == 0) return 0;
+	for (head = s->head.next; head != &s->head && n < count; ) {
+		current = iqueue_entry(head, struct IMSPAGE, head);
+		head = head->next;
+		pointers[n] = current->ptr + pos;
+		if (head != &s->head) sizes[n] = current->size - pos;
+		else sizes[n] = s->pos_write - pos;
+		pos = 0;
+		n++;
+	}
+	return n;
+}
+
+/* find the first ch in stream, returns offset or -1 */
+ilong ims_findc(const struct IMSTREAM *s, int ch)
+{
+	const struct IQUEUEHEAD *head;
+	struct IMSPAGE *current;
+	iulong pos = s->pos_read;
+	ilong offset = 0;
+	if (s->size == 0) return -1;
+	for (head = s->head.next; head != &s->head; ) {
+		const IUINT8 *found;
+		ilong size;
+		current = iqueue_entry(head, struct IMSPAGE, head);
+		head = head->next;
+		if (head != &s->head) size = current->size - pos;
+		else size = s->pos_write - pos;
+		found = (const IUINT8*)memchr(current->ptr + pos, ch, size);
+		if (found != NULL) {
+			return offset + (ilong)(found - (current->ptr + pos));
+		}
+		offset += size;
+		pos = 0;
+	}
+	return -1;
+}
+
+/* get writable space: free space of tail page, then pages in lru */
+int ims_reserve(struct IMSTREAM *s, ilong size, void *pointers[], 
+	ilong sizes[], int count)
+{
+	struct IQUEUEHEAD *head;
+	struct IMSPAGE *current;
+	ilong total = 0;
+	int n = 0;
+	if (count <= 0) return 0;
+	if (!iqueue_is_empty(&s->head)) {
+		current = iqueue_entry(s->head.prev, struct IMSPAGE, head);
+		if (current->size > s->pos_write) {
+			pointers[n] = current->data + s->pos_write;
+			sizes[n] = current->size - s->pos_write;
+			total += sizes[n++];
+		}
+	}
+	for (head = s->lru.next; n < count && total < size; ) {
+		if (head == &s->lru) {
+			current = ims_page_new(s);
+			if (current == NULL) return (n > 0)? n : -1;
+			iqueue_add_tail(&current->head, &s->lru);
+			s->lrusize++;
+		}	else {
+			current = iqueue_entry(head, struct IMSPAGE, head);
+			head = head->next;
+		}
+		pointers[n] = current->data;
+		sizes[n] = current->size;
+		total += sizes[n++];
+	}
+	return n;
+}
+
+/* commit data written into reserved space */
+ilong ims_commit(struct IMSTREAM *s, ilong size)
+{
+	struct IMSPAGE *current;
+	ilong total, canwrite, towrite;
+	for (total = 0; size > 0; size -= towrite, total += towrite) {
+		if (iqueue_is_empty(&s->head)) {
+			canwrite = 0;
+		}	else {
+			current = iqueue_entry(s->head.prev, struct IMSPAGE, head);
+			canwrite = current->size - s->pos_write;
+		}
+		if (canwrite == 0) {
+			assert(s->lrusize > 0);
+			current = iqueue_entry(s->lru.next, struct IMSPAGE, head);
+			iqueue_del(&current->head);
+			s->lrusize--;
+			iqueue_add_tail(&current->head, &s->head);
+			s->pos_write = 0;
+			canwrite = current->size;
+		}
+		towrite = (size <= canwrite)? size : canwrite;
+		s->pos_write += towrite;
+		s->size += towrite;
+	}
+	return total;
+}
+
+/* create shared buffer */
+struct IMSHARED *ims_shared_new(const void *data, ilong size, 
+	void (*release)(void *data, void *user), void *user)
+{
+	struct IMSHARED *shared;
+	size = (size < 0)? 0 : size;
+	if (release == NULL) {
+		shared = (struct IMSHARED*)ikmem_malloc(sizeof(struct IMSHARED) + 
+			size);
+		if (shared == NULL) return NULL;
+		shared->data = (char*)(shared + 1);
+		if (data && size > 0) memcpy(shared->data, data, size);
+	}	else {
+		shared = (struct IMSHARED*)ikmem_malloc(sizeof(struct IMSHARED));
+		if (shared == NULL) return NULL;
+		shared->data = (char*)data;
+	}
+	shared->refcnt = 1;
+	shared->size = size;
+	shared->release = release;
+	shared->user = user;
+	return shared;
+}
+
+/* add reference */
+void ims_shared_ref(struct IMSHARED *shared)
+{
+	IMS_ATOMIC_ADD(&shared->refcnt, 1);
+}
+
+/* drop reference */
+void ims_shared_unref(struct IMSHARED *shared)
+{
+	if (IMS_ATOMIC_ADD(&shared->refcnt, -1) == 0) {
+		if (shared->release) {
+			shared->release(shared->data, shared->user);
+		}
+		ikmem_free(shared);
+	}
+}
+
+/* link part of shared buffer as a page, the page is full for writing */
+ilong ims_write_shared(struct IMSTREAM *s, struct IMSHARED *shared,
+	ilong offset, ilong size)
+{
+	struct IMSPAGE *page;
+	if (offset < 0 || offset > shared->size) return -1;
+	if (size > shared->size - offset) size = shared->size - offset;
+	if (size <= 0) return 0;
+	page = (struct IMSPAGE*)ikmem_malloc(sizeof(struct IMSPAGE));
+	if (page == NULL) return -2;
+	iqueue_init(&page->head);
+	page->index = (iulong)0xfffffffful;
+	page->size = (iulong)size;
+	page->ptr = (IUINT8*)shared->data + offset;
+	page->shared = shared;
+	ims_shared_ref(shared);
+	if (!iqueue_is_empty(&s->head)) {
+		struct IMSPAGE *tail;
+		tail = iqueue_entry(s->head.prev, struct IMSPAGE, head);
+		if (s->size == 0) {
+			/* only a drained page left: recycle it */
+			iqueue_del(&tail->head);
+			ims_page_cache_release(s, tail);
+		}
+		else if (s->pos_write < tail->size) {
+			/* pages before the tail must be full: cut the tail here,
+			   ims_page_cache_release restores its size */
+			tail->size = s->pos_write;
+		}
+	}
+	if (iqueue_is_empty(&s->head)) {
+		s->pos_read = 0;
+	}
+	iqueue_add_tail(&page->head, &s->head);
+	s->pos_write = (iulong)size;
+	s->size += size;
+	return size;
+}
+
 
 /**********************************************************************
  * common string operation
@@ -1698,6 +1945,21 @@ const char *istrcsvtok(const char *text, ilong *next, ilong *size)
 	return text + begin;
 }
 
+/* line splitter: offsets right after each '\n', memchr does the scan */
+ilong istrlines(const char *text, ilong size, ilong ends[], ilong count)
+{
+	const char *ptr = text;
+	const char *endup = text + size;
+	ilong n = 0;
+	while (n < count && ptr < endup) {
+		const char *lf = (const char*)memchr(ptr, '\n', endup - ptr);
+		if (lf == NULL) break;
+		ptr = lf + 1;
+		ends[n++] = (ilong)(ptr - text);
+	}
+	return n;
+}
+
 
 /**********************************************************************
  * ivalue_t string library
@@ -2765,6 +3027,27 @@ void icrypt_rc4_init(unsigned char *box, int *x, int *y,
 	y[0] = Y;
 }
 
+/* one rc4 keystream byte from a word sized state */
+#define ICRYPT_RC4_NEXT(S, X, Y, a, b, k) do { \
+		X = (X + 1) & 0xff; \
+		a = S[X]; \
+		Y = (Y + a) & 0xff; \
+		b = S[Y]; \
+		S[X] = b; \
+		S[Y] = a; \
+		k = S[(a + b) & 0xff]; \
+	}	while (0)
+
+#ifndef ICRYPT_RC4_WIDE
+#define ICRYPT_RC4_WIDE 64
+#endif
+
+#if IWORDS_BIG_ENDIAN
+#define ICRYPT_RC4_SHIFT(i) (56 - ((i) << 3))
+#else
+#define ICRYPT_RC4_SHIFT(i) ((i) << 3)
+#endif
+
 /* rc4_crypt */
 void icrypt_rc4_crypt(unsigned char *box, int *x, int *y, 
 	const unsigned char *src, unsigned char *dst, ilong size)
@@ -2776,6 +3059,31 @@ void icrypt_rc4_crypt(unsigned char *box, int *x, int *y,
 			memmove(dst, src, size);
 	}	else {						/* crypt */
 		int a, b; 
+		if (size >= ICRYPT_RC4_WIDE) {
+			/* the byte box aliases src/dst, so run on a word copy of it
+			   and produce 8 keystream bytes per xor, the layout of box
+			   stays unchanged after being written back */
+			IUINT32 S[256], A, B, K, I = (IUINT32)X, J = (IUINT32)Y;
+			int i;
+			for (i = 0; i < 256; i++) S[i] = box[i];
+			for (; size >= 8; src += 8, dst += 8, size -= 8) {
+				IUINT64 stream = 0, data;
+				for (i = 0; i < 8; i++) {
+					ICRYPT_RC4_NEXT(S, I, J, A, B, K);
+					stream |= ((IUINT64)K) << ICRYPT_RC4_SHIFT(i);
+				}
+				memcpy(&data, src, 8);
+				data ^= stream;
+				memcpy(dst, &data, 8);
+			}
+			for (; size > 0; src++, dst++, size--) {
+				ICRYPT_RC4_NEXT(S, I, J, A, B, K);
+				dst[0] = src[0] ^ (unsigned char)K;
+			}
+			for (i = 0; i < 256; i++) box[i] = (unsigned char)S[i];
+			X = (int)I;
+			Y = (int)J;
+		}
 		for (; size > 0; src++, dst++, size--) {
 			X = (unsigned char)(X + 1);
 			a = box[X];
@@ -1447,9 +1447,57 @@ ilong ims_drop(struct IMSTREAM *s, ilong size);
 /* clear stream */
 void ims_clear(struct IMSTREAM *s);
 
+/* release cached spare pages, an empty stream then holds no memory */
+void ims_trim(struct IMSTREAM *s);
+
 /* get flat ptr and size */
 ilong ims_flat(const struct IMSTREAM *s, void **pointer);
 
+/* get flat ptrs and sizes of up to count pages, returns page count */
+int ims_flatv(const struct IMSTREAM *s, void *pointers[], ilong sizes[],
+	int count);
+
+/* find the first byte ch in stream, returns its offset or -1 */
+ilong ims_findc(const struct IMSTREAM *s, int ch);
+
+/* get writable space of at least size bytes (tail page and spare pages),
+ * fill data there, then ims_commit how many bytes are written.
+ * returns count of pointers, -1 for out of memory */
+int ims_reserve(struct IMSTREAM *s, ilong size, void *pointers[], 
+	ilong sizes[], int count);
+
+/* commit size bytes written into space returned by ims_reserve */
+ilong ims_commit(struct IMSTREAM *s, ilong size);
+
+
+/**********************************************************************
+ * IMSHARED: immutable refcounted buffer, linked into many streams
+ **********************************************************************/
+struct IMSHARED
+{
+	volatile long refcnt;
+	ilong size;
+	char *data;
+	void (*release)(void *data, void *user);
+	void *user;
+};
+
+/* create a shared buffer holding a copy of data when release is NULL,
+ * otherwise reference data and call release(data, user) on last unref.
+ * the caller owns the first reference */
+struct IMSHARED *ims_shared_new(const void *data, ilong size, 
+	void (*release)(void *data, void *user), void *user);
+
+/* add a reference, thread safe */
+void ims_shared_ref(struct IMSHARED *shared);
+
+/* drop a reference, frees it when it is the last one, thread safe */
+void ims_shared_unref(struct IMSHARED *shared);
+
+/* append size bytes at offset of shared without copying */
+ilong ims_write_shared(struct IMSTREAM *s, struct IMSHARED *shared,
+	ilong offset, ilong size);
+
 
 
 /**********************************************************************
@@ -1552,6 +1600,10 @@ ilong istrload(const char *src, ilong size, char *out);
 /* csv tokenizer */
 const char *istrcsvtok(const char *text, ilong *next, ilong *size);
 
+/* find up to count lines in text, stores the offset after each '\n'
+ * into ends and returns how many are found */
+ilong istrlines(const char *text, ilong size, ilong ends[], ilong count);
+
 
 /**********************************************************************
  * ivalue_t string library
@@ -27,6 +27,7 @@
 #include <unistd.h>
 #include <netinet/in.h>
 #include <sys/select.h>
+#include <sys/uio.h>
 
 #ifndef __AVM3__
 #include <poll.h>
@@ -595,6 +596,78 @@ long irecv(int sock, void *buf, long size, int mode)
 	return (long)recv(sock, (char*)buf, size, mode);
 }
 
+/* send vector */
+long isendv(int sock, const void * const vecptr[], const long veclen[],
+	int count, int mode)
+{
+#if defined(__unix) && (!defined(__AVM2__)) && (!defined(__AVM3__))
+	struct iovec vec[ISOCK_IOVMAX];
+	struct msghdr msg;
+	int i;
+	if (count > ISOCK_IOVMAX) count = ISOCK_IOVMAX;
+	for (i = 0; i < count; i++) {
+		vec[i].iov_base = (void*)vecptr[i];
+		vec[i].iov_len = (size_t)veclen[i];
+	}
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = vec;
+	msg.msg_iovlen = count;
+	return (long)sendmsg(sock, &msg, mode);
+#elif defined(_WIN32) && (!defined(_XBOX))
+	WSABUF vec[ISOCK_IOVMAX];
+	DWORD sent = 0;
+	int i;
+	if (count > ISOCK_IOVMAX) count = ISOCK_IOVMAX;
+	for (i = 0; i < count; i++) {
+		vec[i].buf = (char*)vecptr[i];
+		vec[i].len = (u_long)veclen[i];
+	}
+	if (WSASend((SOCKET)sock, vec, (DWORD)count, &sent, (DWORD)mode, 
+		NULL, NULL) != 0) 
+		return -1;
+	return (long)sent;
+#else
+	if (count <= 0) return 0;
+	return isend(sock, vecptr[0], veclen[0], mode);
+#endif
+}
+
+/* recv vector */
+long irecvv(int sock, void * const vecptr[], const long veclen[],
+	int count, int mode)
+{
+#if defined(__unix) && (!defined(__AVM2__)) && (!defined(__AVM3__))
+	struct iovec vec[ISOCK_IOVMAX];
+	struct msghdr msg;
+	int i;
+	if (count > ISOCK_IOVMAX) count = ISOCK_IOVMAX;
+	for (i = 0; i < count; i++) {
+		vec[i].iov_base = vecptr[i];
+		vec[i].iov_len = (size_t)veclen[i];
+	}
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = vec;
+	msg.msg_iovlen = count;
+	return (long)recvmsg(sock, &msg, mode);
+#elif defined(_WIN32) && (!defined(_XBOX))
+	WSABUF vec[ISOCK_IOVMAX];
+	DWORD recvd = 0, flags = (DWORD)mode;
+	int i;
+	if (count > ISOCK_IOVMAX) count = ISOCK_IOVMAX;
+	for (i = 0; i < count; i++) {
+		vec[i].buf = (char*)vecptr[i];
+		vec[i].len = (u_long)veclen[i];
+	}
+	if (WSARecv((SOCKET)sock, vec, (DWORD)count, &recvd, &flags, 
+		NULL, NULL) != 0) 
+		return -1;
+	return (long)recvd;
+#else
+	if (count <= 0) return 0;
+	return irecv(sock, vecptr[0], veclen[0], mode);
+#endif
+}
+
 /* send to remote */
 long isendto(int sock, const void *buf, long size, int mode, 
 			const struct sockaddr *addr, int addrlen)
@@ -1637,6 +1710,15 @@ int inet_tcp_estab(int sock)
 #if defined(__linux__)
 #define IHAVE_EPOLL
 #endif
+#if defined(__linux__) && defined(__has_include) && (!defined(IDISABLE_URING))
+#if __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_EXT_ARG)
+#define IHAVE_URING
+#endif
+#endif
+#endif
 #if defined(__sun) || defined(__sun__)
 #define IHAVE_DEVPOLL
 #endif
@@ -1670,6 +1752,7 @@ struct IPOLL_DRIVER
 	int (*poll_set)(ipolld ipd, int fd, int mask);		
 	int (*poll_wait)(ipolld ipd, int timeval);			
 	int (*poll_event)(ipolld ipd, int *fd, int *event, void **udata);
+	int (*poll_events)(ipolld ipd, struct ipoll_result *out, int max);
 };
 
 /* current poll device */
@@ -1719,6 +1802,10 @@ extern struct IPOLL_DRIVER IPOLL_KEVENT;
 #endif
 #ifdef IHAVE_EPOLL
 extern struct IPOLL_DRIVER IPOLL_EPOLL;
+static int ipe_poll_edge(ipolld ipd);
+#endif
+#ifdef IHAVE_URING
+extern struct IPOLL_DRIVER IPOLL_URING;
 #endif
 #ifdef IHAVE_DEVPOLL
 extern struct IPOLL_DRIVER IPOLL_DEVPOLL;
@@ -1746,6 +1833,9 @@ static struct IPOLL_DRIVER *ipoll_list[] = {
 #ifdef IHAVE_EPOLL
 	&IPOLL_EPOLL,
 #endif
+#ifdef IHAVE_URING
+	&IPOLL_URING,
+#endif
 #ifdef IHAVE_DEVPOLL
 	&IPOLL_DEVPOLL,
 #endif
@@ -1840,6 +1930,11 @@ int ipoll_create(ipolld *ipd, int param)
 	assert(ipd && ipoll_inited);
 	if (ipd == NULL || ipoll_inited == 0) return -1;
 
+	/* edge-triggered mode is only supported by epoll */
+	if (IPOLLDRV.id != IDEVICE_EPOLL) {
+		param &= ~IPOLL_EDGE;
+	}
+
 	pd = (ipolld)ikmalloc(IPOLLDRV.pdsize);
 	if (pd == NULL) return -2;
 
@@ -1898,6 +1993,37 @@ int ipoll_event(ipolld ipd, int *fd, int *event, void **udata)
 	return retval;
 }
 
+/* get events in bulk, drivers without poll_events fall back to loop */
+int ipoll_events(ipolld ipd, struct ipoll_result *out, int max)
+{
+	int count = 0;
+	if (IPOLLDRV.poll_events) {
+		return IPOLLDRV.poll_events(ipd, out, max);
+	}
+	while (count < max) {
+		struct ipoll_result *result = &out[count];
+		if (IPOLLDRV.poll_event(ipd, &result->fd, &result->event, 
+			&result->udata) != 0) break;
+		if (result->event != 0) count++;
+	}
+	return count;
+}
+
+/* edge-triggered or not */
+int ipoll_edge(ipolld ipd)
+{
+#ifdef IHAVE_EPOLL
+	if (IPOLLDRV.id == IDEVICE_EPOLL) {
+		return ipe_poll_edge(ipd);
+	}
+#endif
+	/* multishot poll only reports new readiness, like EPOLLET */
+	if (IPOLLDRV.id == IDEVICE_URING) {
+		return 1;
+	}
+	return 0;
+}
+
 /* vector init */
 static void ipv_init(struct IPVECTOR *vec)
 {
@@ -2036,7 +2162,8 @@ struct IPOLL_DRIVER IPOLL_SELECT = {
 	ips_poll_del,
 	ips_poll_set,
 	ips_poll_wait,
-	ips_poll_event
+	ips_poll_event,
+	NULL
 };
 
 #ifdef PSTRUCT
@@ -2288,7 +2415,8 @@ struct IPOLL_DRIVER IPOLL_POLL = {
 	ipp_poll_del,
 	ipp_poll_set,
 	ipp_poll_wait,
-	ipp_poll_event
+	ipp_poll_event,
+	NULL
 };
 
 #ifdef PSTRUCT
@@ -2549,7 +2677,8 @@ struct IPOLL_DRIVER IPOLL_KEVENT = {
 	ipk_poll_del,
 	ipk_poll_set,
 	ipk_poll_wait,
-	ipk_poll_event
+	ipk_poll_event,
+	NULL
 };
 
 
@@ -2843,6 +2972,7 @@ static int ipe_poll_del(ipolld ipd, int fd);
 static int ipe_poll_set(ipolld ipd, int fd, int mask);
 static int ipe_poll_wait(ipolld ipd, int timeval);
 static int ipe_poll_event(ipolld ipd, int *fd, int *event, void **user);
+static int ipe_poll_events(ipolld ipd, struct ipoll_result *out, int max);
 
 /* epoll device structure */
 typedef struct
@@ -2854,8 +2984,13 @@ typedef struct
 	int results;
 	int cur_res;
 	int usr_len;
+	int edge;
+	int num_chg;
+	int max_chg;
+	int *mchange;
 	struct epoll_event *mresult;
 	struct IPVECTOR vresult;
+	struct IPVECTOR vchange;
 }	IPD_EPOLL;
 
 /* epoll poll descriptor */
@@ -2872,7 +3007,8 @@ struct IPOLL_DRIVER IPOLL_EPOLL = {
 	ipe_poll_del,
 	ipe_poll_set,
 	ipe_poll_wait,
-	ipe_poll_event
+	ipe_poll_event,
+	ipe_poll_events
 };
 
 
@@ -2882,6 +3018,34 @@ struct IPOLL_DRIVER IPOLL_EPOLL = {
 
 #define PSTRUCT IPD_EPOLL
 
+/* epoll_ctl with the mask of fv, remembers what the kernel has */
+static int ipe_poll_ctl(PSTRUCT *ps, int fd, int op)
+{
+	struct epoll_event ee;
+	int mask = ps->fv.fds[fd].mask;
+
+	ee.events = 0;
+	ee.data.fd = fd;
+
+	if (mask & IPOLL_IN) {
+		ee.events |= EPOLLIN;
+	}
+	if (mask & IPOLL_OUT) {
+		ee.events |= EPOLLOUT;
+	}
+	if (mask & IPOLL_ERR) {
+		ee.events |= EPOLLERR | EPOLLHUP;
+	}
+	if (ps->edge) {
+		ee.events |= EPOLLET;
+	}
+
+	if (epoll_ctl(ps->epfd, op, fd, &ee)) return -1;
+	ps->fv.fds[fd].event = mask;
+
+	return 0;
+}
+
 /* epoll startup */
 static int ipe_startup(void)
 {
@@ -2901,7 +3065,9 @@ static int ipe_shutdown(void)
 static int ipe_init_pd(ipolld ipd, int param)
 {
 	PSTRUCT *ps = PDESC(ipd);
-	ps->epfd = epoll_create(param);
+	ps->edge = (param & IPOLL_EDGE)? 1 : 0;
+	param &= ~IPOLL_EDGE;
+	ps->epfd = epoll_create((param > 0)? param : 20);
 	if (ps->epfd < 0) return -1;
 
 #ifdef FD_CLOEXEC
@@ -2909,11 +3075,15 @@ static int ipe_init_pd(ipolld ipd, int param)
 #endif
 
 	ipv_init(&ps->vresult);
+	ipv_init(&ps->vchange);
 	ipoll_fvinit(&ps->fv);
 
 	ps->max_fd = 0;
 	ps->num_fd = 0;
 	ps->usr_len = 0;
+	ps->num_chg = 0;
+	ps->max_chg = 0;
+	ps->mchange = NULL;
 	
 	if (ipv_resize(&ps->vresult, 4 * sizeof(struct epoll_event))) {
 		close(ps->epfd);
@@ -2931,6 +3101,7 @@ static int ipe_destroy_pd(ipolld ipd)
 {
 	PSTRUCT *ps = PDESC(ipd);
 	ipv_destroy(&ps->vresult);
+	ipv_destroy(&ps->vchange);
 	ipoll_fvdestroy(&ps->fv);
 
 	if (ps->epfd >= 0) close(ps->epfd);
@@ -2943,7 +3114,6 @@ static int ipe_poll_add(ipolld ipd, int fd, int mask, void *user)
 {
 	PSTRUCT *ps = PDESC(ipd);
 	int usr_nlen, i;
-	struct epoll_event ee;
 
 	if (ps->num_fd >= ps->max_fd) {
 		i = (ps->max_fd <= 0)? 4 : ps->max_fd * 2;
@@ -2959,6 +3129,8 @@ static int ipe_poll_add(ipolld ipd, int fd, int mask, void *user)
 			ps->fv.fds[i].fd = -1;
 			ps->fv.fds[i].user = NULL;
 			ps->fv.fds[i].mask = 0;
+			ps->fv.fds[i].event = 0;
+			ps->fv.fds[i].index = -1;
 		}
 		ps->usr_len = usr_nlen;
 	}
@@ -2969,16 +3141,10 @@ static int ipe_poll_add(ipolld ipd, int fd, int mask, void *user)
 	}
 	ps->fv.fds[fd].fd = fd;
 	ps->fv.fds[fd].user = user;
-	ps->fv.fds[fd].mask = mask;
-
-	ee.events = 0;
-	ee.data.fd = fd;
-
-	if (mask & IPOLL_IN) ee.events |= EPOLLIN;
-	if (mask & IPOLL_OUT) ee.events |= EPOLLOUT;
-	if (mask & IPOLL_ERR) ee.events |= EPOLLERR | EPOLLHUP;
+	ps->fv.fds[fd].mask = mask & (IPOLL_IN | IPOLL_OUT | IPOLL_ERR);
 
-	if (epoll_ctl(ps->epfd, EPOLL_CTL_ADD, fd, &ee)) {
+	/* added at once so that errors reach the caller */
+	if (ipe_poll_ctl(ps, fd, EPOLL_CTL_ADD)) {
 		ps->fv.fds[fd].fd = -1;
 		ps->fv.fds[fd].user = NULL;
 		ps->fv.fds[fd].mask = 0;
@@ -3001,24 +3167,24 @@ static int ipe_poll_del(ipolld ipd, int fd)
 	ee.events = 0;
 	ee.data.fd = fd;
 
+	/* removed at once: the fd is usually closed and reused right after,
+	 * a pending change of it is dropped by resetting index */
 	epoll_ctl(ps->epfd, EPOLL_CTL_DEL, fd, &ee);
 	ps->num_fd--;
 	ps->fv.fds[fd].fd = -1;
 	ps->fv.fds[fd].user = NULL;
 	ps->fv.fds[fd].mask = 0;
+	ps->fv.fds[fd].event = 0;
+	ps->fv.fds[fd].index = -1;
 
 	return 0;
 }
 
-/* epoll set event mask */
+/* epoll set event mask: deferred to the next ipe_poll_wait, so several
+ * changes of one fd in a loop iteration cost one epoll_ctl at most */
 static int ipe_poll_set(ipolld ipd, int fd, int mask)
 {
 	PSTRUCT *ps = PDESC(ipd);
-	struct epoll_event ee;
-	int retval;
-
-	ee.events = 0;
-	ee.data.fd = fd;
 
 	if ((unsigned int)fd >= (unsigned int)ps->usr_len) return -1;
 	if (fd < 0) return -1;
@@ -3026,27 +3192,52 @@ static int ipe_poll_set(ipolld ipd, int fd, int mask)
 
 	ps->fv.fds[fd].mask = mask & (IPOLL_IN | IPOLL_OUT | IPOLL_ERR);
 
-	if (mask & IPOLL_IN) {
-		ee.events |= EPOLLIN;
-	}
-	if (mask & IPOLL_OUT) {
-		ee.events |= EPOLLOUT;
-	}
-	if (mask & IPOLL_ERR) {
-		ee.events |= EPOLLERR | EPOLLHUP;
+	if (ps->fv.fds[fd].index >= 0) return 0;
+
+	if (ps->num_chg >= ps->max_chg) {
+		int newsize = (ps->max_chg <= 0)? 64 : ps->max_chg * 2;
+		if (ipv_resize(&ps->vchange, newsize * sizeof(int))) {
+			/* out of memory: fall back to an immediate syscall */
+			if (ipe_poll_ctl(ps, fd, EPOLL_CTL_MOD)) return -10000;
+			return 0;
+		}
+		ps->mchange = (int*)ps->vchange.data;
+		ps->max_chg = newsize;
 	}
 
-	retval = epoll_ctl(ps->epfd, EPOLL_CTL_MOD, fd, &ee);
-	if (retval) return -10000 + retval;
+	ps->fv.fds[fd].index = ps->num_chg;
+	ps->mchange[ps->num_chg++] = fd;
 
 	return 0;
 }
 
+/* epoll apply deferred changes */
+static void ipe_poll_apply(PSTRUCT *ps)
+{
+	int i;
+	for (i = 0; i < ps->num_chg; i++) {
+		int fd = ps->mchange[i];
+		struct IPOLLFD *pfd = &ps->fv.fds[fd];
+		/* deleted, or deleted and added again after this entry */
+		if (pfd->fd < 0 || pfd->index != i) continue;
+		pfd->index = -1;
+		/* level-triggered: nothing to do if the kernel has it already,
+		 * edge-triggered: a modify also re-arms, keep it */
+		if (pfd->mask == pfd->event && ps->edge == 0) continue;
+		ipe_poll_ctl(ps, fd, EPOLL_CTL_MOD);
+	}
+	ps->num_chg = 0;
+}
+
 /* epoll wait */
 static int ipe_poll_wait(ipolld ipd, int timeval)
 {
 	PSTRUCT *ps = PDESC(ipd);
 
+	if (ps->num_chg > 0) {
+		ipe_poll_apply(ps);
+	}
+
 	ps->results = epoll_wait(ps->epfd, ps->mresult, 
 		ps->max_fd * 2, timeval);
 	ps->cur_res = 0;
@@ -3078,7 +3269,7 @@ static int ipe_poll_event(ipolld ipd, int *fd, int *event, void **user)
 		epoll_ctl(ps->epfd, EPOLL_CTL_DEL, n, &uu);
 	}	else {
 		revent &= ps->fv.fds[n].mask;
-		if (revent == 0) {
+		if (revent == 0 && ps->edge == 0) {
 			ipe_poll_set(ipd, n, ps->fv.fds[n].mask);
 		}
 	}
@@ -3089,6 +3280,591 @@ static int ipe_poll_event(ipolld ipd, int *fd, int *event, void **user)
 	return 0;
 }
 
+/* epoll query events in bulk, no indirect call per event */
+static int ipe_poll_events(ipolld ipd, struct ipoll_result *out, int max)
+{
+	PSTRUCT *ps = PDESC(ipd);
+	int count = 0;
+	while (count < max && ps->cur_res < ps->results) {
+		struct ipoll_result *result = &out[count];
+		ipe_poll_event(ipd, &result->fd, &result->event, &result->udata);
+		if (result->event != 0) count++;
+	}
+	return count;
+}
+
+/* epoll edge-triggered */
+static int ipe_poll_edge(ipolld ipd)
+{
+	PSTRUCT *ps = PDESC(ipd);
+	return ps->edge;
+}
+
+
+#endif
+
+
+/*===================================================================*/
+/* POLL DRIVER - IO_URING                                            */
+/*===================================================================*/
+
+#ifdef IHAVE_URING
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <linux/io_uring.h>
+
+#ifndef IURING_ENTRIES
+#define IURING_ENTRIES 1024
+#endif
+
+#define IURING_IGNORE	((IUINT64)0xffffffffffffffffULL)
+#define IURING_REMOVE	((IUINT64)1 << 63)
+#define IURING_DIRTY	1
+#define IURING_ARMED	2
+
+static int ipr_startup(void);
+static int ipr_shutdown(void);
+static int ipr_init_pd(ipolld ipd, int param);
+static int ipr_destroy_pd(ipolld ipd);
+static int ipr_poll_add(ipolld ipd, int fd, int mask, void *user);
+static int ipr_poll_del(ipolld ipd, int fd);
+static int ipr_poll_set(ipolld ipd, int fd, int mask);
+static int ipr_poll_wait(ipolld ipd, int timeval);
+static int ipr_poll_event(ipolld ipd, int *fd, int *event, void **user);
+
+/* harvested completion */
+struct IURINGRES
+{
+	IUINT64 data;
+	int res;
+};
+
+/* io_uring device structure */
+typedef struct
+{
+	struct IPOLLFV fv;
+	int ring;
+	int usr_len;
+	int multi;
+	int pending;
+	int num_chg;
+	int max_chg;
+	int results;
+	int cur_res;
+	int max_res;
+	unsigned char *sq_ptr;
+	unsigned char *cq_ptr;
+	size_t sq_size;
+	size_t cq_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	volatile unsigned *sq_head;
+	volatile unsigned *sq_tail;
+	unsigned *sq_array;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	volatile unsigned *cq_head;
+	volatile unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	struct IURINGRES *mresult;
+	int *mchange;
+	struct IPVECTOR vresult;
+	struct IPVECTOR vchange;
+}	IPD_URING;
+
+/* io_uring poll descriptor */
+struct IPOLL_DRIVER IPOLL_URING = {
+	sizeof (IPD_URING),
+	IDEVICE_URING,
+	90,
+	"IO_URING",
+	ipr_startup,
+	ipr_shutdown,
+	ipr_init_pd,
+	ipr_destroy_pd,
+	ipr_poll_add,
+	ipr_poll_del,
+	ipr_poll_set,
+	ipr_poll_wait,
+	ipr_poll_event,
+	NULL
+};
+
+
+#ifdef PSTRUCT
+#undef PSTRUCT
+#endif
+
+#define PSTRUCT IPD_URING
+
+static int ipr_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int ipr_enter(int ring, unsigned to_submit, unsigned min_complete,
+	unsigned flags, void *arg, size_t argsz)
+{
+	return (int)syscall(__NR_io_uring_enter, ring, to_submit,
+		min_complete, flags, arg, argsz);
+}
+
+/* io_uring startup: needs IORING_FEAT_EXT_ARG for timed waits */
+static int ipr_startup(void)
+{
+	struct io_uring_params p;
+	int ring;
+	memset(&p, 0, sizeof(p));
+	ring = ipr_setup(4, &p);
+	if (ring < 0) return -1000 - errno;
+	close(ring);
+	if ((p.features & IORING_FEAT_EXT_ARG) == 0) return -2;
+	return 0;
+}
+
+/* io_uring shutdown */
+static int ipr_shutdown(void)
+{
+	return 0;
+}
+
+/* unmap rings */
+static void ipr_unmap(PSTRUCT *ps)
+{
+	if (ps->sqes) munmap(ps->sqes, ps->sqes_size);
+	if (ps->cq_ptr && ps->cq_ptr != ps->sq_ptr)
+		munmap(ps->cq_ptr, ps->cq_size);
+	if (ps->sq_ptr) munmap(ps->sq_ptr, ps->sq_size);
+	ps->sqes = NULL;
+	ps->cq_ptr = NULL;
+	ps->sq_ptr = NULL;
+}
+
+/* io_uring init poll descriptor */
+static int ipr_init_pd(ipolld ipd, int param)
+{
+	PSTRUCT *ps = PDESC(ipd);
+	struct io_uring_params p;
+	void *ptr;
+
+	memset(&p, 0, sizeof(p));
+	param = param;
+
+	ps->sq_ptr = NULL;
+	ps->cq_ptr = NULL;
+	ps->sqes = NULL;
+	ps->ring = ipr_setup(IURING_ENTRIES, &p);
+	if (ps->ring < 0) return -1;
+
+#ifdef FD_CLOEXEC
+	fcntl(ps->ring, F_SETFD, FD_CLOEXEC);
+#endif
+
+	ps->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ps->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ps->cq_size > ps->sq_size) ps->sq_size = ps->cq_size;
+		ps->cq_size = ps->sq_size;
+	}
+
+	ptr = mmap(NULL, ps->sq_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ps->ring, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED) {
+		close(ps->ring);
+		return -2;
+	}
+	ps->sq_ptr = (unsigned char*)ptr;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ps->cq_ptr = ps->sq_ptr;
+	}	else {
+		ptr = mmap(NULL, ps->cq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ps->ring, IORING_OFF_CQ_RING);
+		if (ptr == MAP_FAILED) {
+			ipr_unmap(ps);
+			close(ps->ring);
+			return -3;
+		}
+		ps->cq_ptr = (unsigned char*)ptr;
+	}
+
+	ps->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ptr = mmap(NULL, ps->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ps->ring, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED) {
+		ipr_unmap(ps);
+		close(ps->ring);
+		return -4;
+	}
+	ps->sqes = (struct io_uring_sqe*)ptr;
+
+	ps->sq_head = (volatile unsigned*)(ps->sq_ptr + p.sq_off.head);
+	ps->sq_tail = (volatile unsigned*)(ps->sq_ptr + p.sq_off.tail);
+	ps->sq_mask = *(unsigned*)(ps->sq_ptr + p.sq_off.ring_mask);
+	ps->sq_array = (unsigned*)(ps->sq_ptr + p.sq_off.array);
+	ps->sq_entries = p.sq_entries;
+	ps->cq_head = (volatile unsigned*)(ps->cq_ptr + p.cq_off.head);
+	ps->cq_tail = (volatile unsigned*)(ps->cq_ptr + p.cq_off.tail);
+	ps->cq_mask = *(unsigned*)(ps->cq_ptr + p.cq_off.ring_mask);
+	ps->cqes = (struct io_uring_cqe*)(ps->cq_ptr + p.cq_off.cqes);
+
+	ipv_init(&ps->vresult);
+	ipv_init(&ps->vchange);
+	ipoll_fvinit(&ps->fv);
+
+	ps->usr_len = 0;
+	ps->multi = 1;
+	ps->pending = 0;
+	ps->num_chg = 0;
+	ps->max_chg = 0;
+	ps->mchange = NULL;
+	ps->results = 0;
+	ps->cur_res = 0;
+	ps->max_res = 0;
+
+	if (ipv_resize(&ps->vresult, p.cq_entries * sizeof(struct IURINGRES))) {
+		ipr_destroy_pd(ipd);
+		return -5;
+	}
+
+	ps->mresult = (struct IURINGRES*)ps->vresult.data;
+	ps->max_res = p.cq_entries;
+
+	return 0;
+}
+
+/* io_uring destroy descriptor */
+static int ipr_destroy_pd(ipolld ipd)
+{
+	PSTRUCT *ps = PDESC(ipd);
+	ipv_destroy(&ps->vresult);
+	ipv_destroy(&ps->vchange);
+	ipoll_fvdestroy(&ps->fv);
+	ipr_unmap(ps);
+	if (ps->ring >= 0) close(ps->ring);
+	ps->ring = -1;
+	return 0;
+}
+
+/* submit queued sqes without waiting */
+static int ipr_submit(PSTRUCT *ps)
+{
+	int hr = 0;
+	while (ps->pending > 0) {
+		hr = ipr_enter(ps->ring, ps->pending, 0, 0, NULL, 0);
+		if (hr < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		ps->pending -= hr;
+		if (hr == 0) break;
+	}
+	return 0;
+}
+
+/* get a free sqe, submits the queue when it is full */
+static struct io_uring_sqe *ipr_sqe(PSTRUCT *ps)
+{
+	unsigned tail = *ps->sq_tail;
+	unsigned index;
+	struct io_uring_sqe *sqe;
+	if (tail - *ps->sq_head >= ps->sq_entries) {
+		ipr_submit(ps);
+		if (tail - *ps->sq_head >= ps->sq_entries) return NULL;
+	}
+	index = tail & ps->sq_mask;
+	sqe = &ps->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	ps->sq_array[index] = index;
+	return sqe;
+}
+
+/* publish the sqe returned by ipr_sqe */
+static void ipr_push(PSTRUCT *ps)
+{
+	__sync_synchronize();
+	*ps->sq_tail = *ps->sq_tail + 1;
+	__sync_synchronize();
+	ps->pending++;
+}
+
+/* user_data of the current poll request of fd */
+static IUINT64 ipr_data(PSTRUCT *ps, int fd)
+{
+	IUINT64 gen = (unsigned)ps->fv.fds[fd].index & 0x7fffffff;
+	return (gen << 32) | (unsigned)fd;
+}
+
+/* queue a poll request for fd with current mask */
+static int ipr_arm(PSTRUCT *ps, int fd)
+{
+	struct io_uring_sqe *sqe = ipr_sqe(ps);
+	int mask = ps->fv.fds[fd].mask;
+	unsigned events = 0;
+	if (sqe == NULL) return -1;
+	if (mask & IPOLL_IN) events |= POLLIN;
+	if (mask & IPOLL_OUT) events |= POLLOUT;
+	if (mask & IPOLL_ERR) events |= POLLERR | POLLHUP;
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+	events = (events << 16) | (events >> 16);
+#endif
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = events;
+	sqe->len = ps->multi? IORING_POLL_ADD_MULTI : 0;
+	sqe->user_data = ipr_data(ps, fd);
+	ipr_push(ps);
+	return 0;
+}
+
+/* queue a cancellation of a poll request */
+static int ipr_remove(PSTRUCT *ps, IUINT64 data)
+{
+	struct io_uring_sqe *sqe = ipr_sqe(ps);
+	if (sqe == NULL) return -1;
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = data;
+	sqe->user_data = data | IURING_REMOVE;
+	ipr_push(ps);
+	return 0;
+}
+
+/* cancel the current poll request of fd, later events become stale */
+static void ipr_disarm(PSTRUCT *ps, int fd)
+{
+	if (ps->fv.fds[fd].event & IURING_ARMED) {
+		ipr_remove(ps, ipr_data(ps, fd));
+	}
+	ps->fv.fds[fd].event = 0;
+	ps->fv.fds[fd].index++;
+}
+
+/* mark fd to be armed at next ipr_poll_wait */
+static int ipr_dirty(PSTRUCT *ps, int fd)
+{
+	if (ps->num_chg >= ps->max_chg) {
+		int size = (ps->max_chg <= 0)? 64 : ps->max_chg * 2;
+		if (ipv_resize(&ps->vchange, size * sizeof(int))) return -1;
+		ps->mchange = (int*)ps->vchange.data;
+		ps->max_chg = size;
+	}
+	ps->mchange[ps->num_chg++] = fd;
+	ps->fv.fds[fd].event = IURING_DIRTY;
+	return 0;
+}
+
+/* arm dirty descriptors, add/set pairs are coalesced into one sqe */
+static void ipr_flush(PSTRUCT *ps)
+{
+	int i, j;
+	for (i = 0, j = 0; i < ps->num_chg; i++) {
+		int fd = ps->mchange[i];
+		if (ps->fv.fds[fd].fd < 0) continue;
+		if ((ps->fv.fds[fd].event & IURING_DIRTY) == 0) continue;
+		if (ipr_arm(ps, fd) != 0) {
+			ps->mchange[j++] = fd;
+			continue;
+		}
+		ps->fv.fds[fd].event = IURING_ARMED;
+	}
+	ps->num_chg = j;
+}
+
+/* io_uring add file */
+static int ipr_poll_add(ipolld ipd, int fd, int mask, void *user)
+{
+	PSTRUCT *ps = PDESC(ipd);
+	int usr_nlen, i;
+
+	if (fd < 0) return -1;
+	if (fd >= ps->usr_len) {
+		usr_nlen = fd + 128;
+		if (ipoll_fvresize(&ps->fv, usr_nlen)) return -1;
+		for (i = ps->usr_len; i < usr_nlen; i++) {
+			ps->fv.fds[i].fd = -1;
+			ps->fv.fds[i].user = NULL;
+			ps->fv.fds[i].mask = 0;
+			ps->fv.fds[i].event = 0;
+			ps->fv.fds[i].index = 0;
+		}
+		ps->usr_len = usr_nlen;
+	}
+	if (ps->fv.fds[fd].fd >= 0) {
+		ps->fv.fds[fd].user = user;
+		ipr_poll_set(ipd, fd, mask);
+		return 0;
+	}
+	ps->fv.fds[fd].fd = fd;
+	ps->fv.fds[fd].user = user;
+	ps->fv.fds[fd].mask = mask & (IPOLL_IN | IPOLL_OUT | IPOLL_ERR);
+
+	if (ipr_dirty(ps, fd) != 0) {
+		ps->fv.fds[fd].fd = -1;
+		ps->fv.fds[fd].user = NULL;
+		ps->fv.fds[fd].mask = 0;
+		return -3;
+	}
+
+	return 0;
+}
+
+/* io_uring delete file */
+static int ipr_poll_del(ipolld ipd, int fd)
+{
+	PSTRUCT *ps = PDESC(ipd);
+
+	if ((unsigned int)fd >= (unsigned int)ps->usr_len) return -1;
+	if (ps->fv.fds[fd].fd < 0) return -2;
+
+	ipr_disarm(ps, fd);
+	ps->fv.fds[fd].fd = -1;
+	ps->fv.fds[fd].user = NULL;
+	ps->fv.fds[fd].mask = 0;
+
+	/* submit the removal now: the poll request holds a reference to
+	   the file, a close() right after this must really close it */
+	ipr_submit(ps);
+
+	return 0;
+}
+
+/* io_uring set event mask */
+static int ipr_poll_set(ipolld ipd, int fd, int mask)
+{
+	PSTRUCT *ps = PDESC(ipd);
+
+	if ((unsigned int)fd >= (unsigned int)ps->usr_len) return -1;
+	if (ps->fv.fds[fd].fd < 0) return -2;
+
+	mask = mask & (IPOLL_IN | IPOLL_OUT | IPOLL_ERR);
+	if (ps->fv.fds[fd].mask == mask) return 0;
+
+	ps->fv.fds[fd].mask = mask;
+
+	if (ps->fv.fds[fd].event & IURING_DIRTY) return 0;
+
+	ipr_disarm(ps, fd);
+
+	if (ipr_dirty(ps, fd) != 0) return -3;
+
+	return 0;
+}
+
+/* io_uring wait: submits pending requests and harvests completions */
+static int ipr_poll_wait(ipolld ipd, int timeval)
+{
+	PSTRUCT *ps = PDESC(ipd);
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned head, tail, flags;
+	int hr;
+
+	flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+
+	memset(&arg, 0, sizeof(arg));
+	if (timeval >= 0) {
+		ts.tv_sec = timeval / 1000;
+		ts.tv_nsec = (timeval % 1000) * 1000000;
+		arg.ts = (IUINT64)(size_t)&ts;
+	}
+
+	ps->results = 0;
+	ps->cur_res = 0;
+
+	ipr_flush(ps);
+
+	head = *ps->cq_head;
+	tail = *ps->cq_tail;
+
+	if (head == tail || ps->pending > 0) {
+		unsigned wait = (head == tail && timeval != 0)? 1 : 0;
+		hr = ipr_enter(ps->ring, ps->pending, wait, flags,
+			&arg, sizeof(arg));
+		if (hr >= 0) {
+			ps->pending -= hr;
+		}
+		else if (errno != ETIME && errno != EINTR && errno != EBUSY) {
+			return -1;
+		}
+	}
+
+	__sync_synchronize();
+	head = *ps->cq_head;
+	tail = *ps->cq_tail;
+
+	for (; head != tail && ps->results < ps->max_res; head++) {
+		struct io_uring_cqe *cqe = &ps->cqes[head & ps->cq_mask];
+		struct IURINGRES *r;
+		int fd;
+		if (cqe->user_data == IURING_IGNORE) continue;
+		if (cqe->user_data & IURING_REMOVE) {
+			/* the request is completing right now: try it again */
+			if (cqe->res == -EALREADY) {
+				ipr_remove(ps, cqe->user_data & ~IURING_REMOVE);
+			}
+			continue;
+		}
+		r = &ps->mresult[ps->results++];
+		r->data = cqe->user_data;
+		r->res = cqe->res;
+		if (cqe->flags & IORING_CQE_F_MORE) continue;
+		/* one-shot poll or multishot terminated: re-arm if still live */
+		fd = (int)(r->data & 0xffffffff);
+		if (fd < 0 || fd >= ps->usr_len || ps->fv.fds[fd].fd < 0) continue;
+		if (r->data != ipr_data(ps, fd)) continue;
+		if (r->res == -EINVAL && ps->multi) {
+			ps->multi = 0;
+			r->res = 0;
+		}
+		if (r->res >= 0 && ipr_arm(ps, fd) != 0) {
+			/* sq still full: retry it in ipr_flush of next wait */
+			ipr_dirty(ps, fd);
+		}
+	}
+
+	__sync_synchronize();
+	*ps->cq_head = head;
+
+	return ps->results;
+}
+
+/* io_uring query event */
+static int ipr_poll_event(ipolld ipd, int *fd, int *event, void **user)
+{
+	PSTRUCT *ps = PDESC(ipd);
+	struct IURINGRES *r;
+	int revent = 0, n;
+
+	if (ps->cur_res >= ps->results) return -1;
+
+	r = &ps->mresult[ps->cur_res++];
+	n = (int)(r->data & 0xffffffff);
+	if (fd) *fd = n;
+
+	if (ps->fv.fds[n].fd < 0 || r->data != ipr_data(ps, n)) {
+		revent = 0;
+	}
+	else if (r->res < 0) {
+		revent = (r->res == -ECANCELED)? 0 : IPOLL_ERR;
+	}
+	else {
+		if (r->res & POLLIN) revent |= IPOLL_IN;
+		if (r->res & POLLOUT) revent |= IPOLL_OUT;
+		if (r->res & (POLLERR | POLLHUP)) revent |= IPOLL_ERR;
+		revent &= ps->fv.fds[n].mask;
+	}
+
+	if (event) *event = revent;
+	if (user) *user = ps->fv.fds[n].user;
+
+	return 0;
+}
+
 
 #endif
 
@@ -3154,7 +3930,8 @@ struct IPOLL_DRIVER IPOLL_DEVPOLL = {
 	ipu_poll_del,
 	ipu_poll_set,
 	ipu_poll_wait,
-	ipu_poll_event
+	ipu_poll_event,
+	NULL
 };
 
 
@@ -3531,7 +4308,8 @@ struct IPOLL_DRIVER IPOLL_POLLSET = {
 	ipx_poll_del,
 	ipx_poll_set,
 	ipx_poll_wait,
-	ipx_poll_event
+	ipx_poll_event,
+	NULL
 };
 
 
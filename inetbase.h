@@ -575,6 +575,18 @@ long isend(int sock, const void *buf, long size, int mode);
 /* receive */
 long irecv(int sock, void *buf, long size, int mode);
 
+#ifndef ISOCK_IOVMAX
+#define ISOCK_IOVMAX	64
+#endif
+
+/* send vector: gather up to ISOCK_IOVMAX buffers in one call */
+long isendv(int sock, const void * const vecptr[], const long veclen[],
+	int count, int mode);
+
+/* recv vector: scatter into up to ISOCK_IOVMAX buffers in one call */
+long irecvv(int sock, void * const vecptr[], const long veclen[],
+	int count, int mode);
+
 /* sendto */
 long isendto(int sock, const void *buf, long size, int mode, 
 	const struct sockaddr *addr, int addrlen);
@@ -742,6 +754,7 @@ int inet_tcp_estab(int sock);
 #define IDEVICE_POLLSET		6
 #define IDEVICE_RTSIG		7
 #define IDEVICE_WINCP		8
+#define IDEVICE_URING		9
 
 #ifndef IPOLL_IN
 #define IPOLL_IN	1
@@ -755,8 +768,20 @@ int inet_tcp_estab(int sock);
 #define IPOLL_ERR	4
 #endif
 
+#ifndef IPOLL_EDGE
+#define IPOLL_EDGE	0x40000000	/* ipoll_create: edge-triggered (epoll) */
+#endif
+
 typedef void * ipolld;
 
+/* one result of ipoll_events */
+struct ipoll_result
+{
+	int fd;
+	int event;
+	void *udata;
+};
+
 /* init poll device */
 int ipoll_init(int device);
 
@@ -787,6 +812,13 @@ int ipoll_wait(ipolld ipd, int millisecond);
 /* query one event: loop call it until it returns non-zero */
 int ipoll_event(ipolld ipd, int *fd, int *event, void **udata);
 
+/* query events in bulk: fills up to max results with non-zero events,
+ * returns how many were filled, zero when all events are consumed */
+int ipoll_events(ipolld ipd, struct ipoll_result *out, int max);
+
+/* returns 1 if the descriptor is edge-triggered, 0 for level-triggered */
+int ipoll_edge(ipolld ipd);
+
 
 
 /*===================================================================*/
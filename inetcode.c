@@ -20,6 +20,11 @@
 #include <netinet/tcp.h>
 #endif
 
+#if defined(__linux__) && (!defined(ASYNC_CORE_NO_EVENTFD))
+#include <sys/eventfd.h>
+#define ASYNC_CORE_EVENTFD
+#endif
+
 #elif (defined(_WIN32) || defined(WIN32))
 #if ((!defined(_M_PPC)) && (!defined(_M_PPC_BE)) && (!defined(_XBOX)))
 #include <mmsystem.h>
@@ -189,6 +194,163 @@ int inet_socketpair(int fds[2])
 #define ASYNC_SOCK_MAXSIZE 0x800000
 #endif
 
+#ifndef ASYNC_SOCK_DRAIN
+#define ASYNC_SOCK_DRAIN 8	/* max reads per edge before yielding */
+#endif
+
+#ifndef ASYNC_SOCK_RECVVEC
+#define ASYNC_SOCK_RECVVEC 8
+#endif
+
+#define ASYNC_SOCK_HEADROOM 4
+
+/* bump a counter of the sock and of the core aggregate it feeds */
+#define ASYNC_SOCK_STAT_ADD(s, name, n) \
+    do { (s)->stat.name += (n); \
+		if ((s)->total) (s)->total->name += (n); } while (0)
+
+#define ASYNC_SOCK_HEADMAX 10	/* longest header: 64 bits varint */
+#define ASYNC_SOCK_VARINT 5		/* longest varint accepted: 32 bits */
+
+#ifndef ASYNC_SOCK_LINES
+#define ASYNC_SOCK_LINES 64
+#endif
+
+#ifndef ASYNC_CORE_SHARE_MIN
+#define ASYNC_CORE_SHARE_MIN 256
+#endif
+
+/* run a span through every stage, the first one may copy src to dst */
+static inline void async_sock_chain_run(CAsyncTransform *chain, 
+	const void *src, void *dst, long size)
+{
+	for (; chain != NULL; chain = chain->next) {
+		chain->process(chain, src, dst, size);
+		src = dst;
+	}
+}
+
+/* append a stage to the send or recv chain, NULL releases the chain */
+int async_sock_transform(CAsyncSock *asyncsock, int dir, 
+	CAsyncTransform *stage)
+{
+	CAsyncTransform **chain;
+	chain = (dir == ASYNC_TRANSFORM_SEND)? 
+		&asyncsock->encoder : &asyncsock->decoder;
+	if (stage == NULL) {
+		while (chain[0] != NULL) {
+			stage = chain[0];
+			chain[0] = stage->next;
+			stage->next = NULL;
+			if (stage->release) stage->release(stage);
+		}
+		return 0;
+	}
+	if (stage->process == NULL) return -1;
+	while (chain[0] != NULL) chain = &(chain[0]->next);
+	stage->next = NULL;
+	chain[0] = stage;
+	return 0;
+}
+
+/* rc4 stage, only allocated for sockets with a key */
+struct CAsyncRc4
+{
+	CAsyncTransform stage;
+	int x;
+	int y;
+	unsigned char box[256];
+};
+
+static void async_sock_rc4_process(CAsyncTransform *self, const void *src,
+	void *dst, long size)
+{
+	struct CAsyncRc4 *rc4 = (struct CAsyncRc4*)self;
+	icrypt_rc4_crypt(rc4->box, &rc4->x, &rc4->y, 
+		(const unsigned char*)src, (unsigned char*)dst, size);
+}
+
+static void async_sock_rc4_release(CAsyncTransform *self)
+{
+	ikmem_free(self);
+}
+
+/* init, replace or remove (keylen <= 0) the rc4 stage of a chain */
+static void async_sock_rc4_key(CAsyncTransform **chain, 
+	const unsigned char *key, int keylen)
+{
+	struct CAsyncRc4 *rc4;
+	for (; chain[0] != NULL; chain = &(chain[0]->next)) {
+		if (chain[0]->process == async_sock_rc4_process) break;
+	}
+	if (key == NULL || keylen <= 0) {
+		if (chain[0] != NULL) {
+			CAsyncTransform *stage = chain[0];
+			chain[0] = stage->next;
+			stage->release(stage);
+		}
+		return;
+	}
+	if (chain[0] == NULL) {
+		rc4 = (struct CAsyncRc4*)ikmem_malloc(sizeof(struct CAsyncRc4));
+		if (rc4 == NULL) return;
+		rc4->stage.next = NULL;
+		rc4->stage.process = async_sock_rc4_process;
+		rc4->stage.release = async_sock_rc4_release;
+		rc4->stage.user = NULL;
+		chain[0] = &rc4->stage;
+	}
+	rc4 = (struct CAsyncRc4*)chain[0];
+	icrypt_rc4_init(rc4->box, &rc4->x, &rc4->y, key, keylen);
+}
+
+/* working buffer, allocated when line splitting first needs it */
+static char *async_sock_buffer(CAsyncSock *asyncsock)
+{
+	if (asyncsock->buffer == NULL) {
+		if (asyncsock->external == NULL) {
+			asyncsock->buffer = (char*)ikmem_malloc(ASYNC_SOCK_BUFSIZE);
+			if (asyncsock->buffer == NULL) return NULL;
+			asyncsock->bufsize = ASYNC_SOCK_BUFSIZE;
+		}	else {
+			asyncsock->buffer = asyncsock->external;
+		}
+	}
+	return asyncsock->buffer;
+}
+
+/* line buffer, allocated for the first partial line and kept until */
+/* the sock is destroyed, an empty one holds no pages               */
+static struct IMSTREAM *async_sock_line(CAsyncSock *asyncsock)
+{
+	if (asyncsock->linemsg == NULL) {
+		struct IMSTREAM *s;
+		s = (struct IMSTREAM*)ikmem_malloc(sizeof(struct IMSTREAM));
+		if (s == NULL) return NULL;
+		ims_init(s, asyncsock->recvmsg.fixed_pages, 0, 0);
+		asyncsock->linemsg = s;
+	}
+	return asyncsock->linemsg;
+}
+
+/* drop the pending partial line and give its pages back */
+static void async_sock_line_clear(CAsyncSock *asyncsock)
+{
+	if (asyncsock->linemsg != NULL) {
+		ims_clear(asyncsock->linemsg);
+		ims_trim(asyncsock->linemsg);
+	}
+}
+
+static void async_sock_line_free(CAsyncSock *asyncsock)
+{
+	if (asyncsock->linemsg != NULL) {
+		ims_destroy(asyncsock->linemsg);
+		ikmem_free(asyncsock->linemsg);
+		asyncsock->linemsg = NULL;
+	}
+}
+
 /* create a new asyncsock */
 void async_sock_init(CAsyncSock *asyncsock, struct IMEMNODE *nodes)
 {
@@ -202,10 +364,8 @@ void async_sock_init(CAsyncSock *asyncsock, struct IMEMNODE *nodes)
 	asyncsock->time = 0;
 	asyncsock->buffer = NULL;
 	asyncsock->header = 0;
-	asyncsock->rc4_send_x = -1;
-	asyncsock->rc4_send_y = -1;
-	asyncsock->rc4_recv_x = -1;
-	asyncsock->rc4_recv_y = -1;
+	asyncsock->encoder = NULL;
+	asyncsock->decoder = NULL;
 	asyncsock->external = NULL;
 	asyncsock->bufsize = 0;
 	asyncsock->maxsize = ASYNC_SOCK_MAXSIZE;
@@ -214,8 +374,22 @@ void async_sock_init(CAsyncSock *asyncsock, struct IMEMNODE *nodes)
 	asyncsock->mask = 0;
 	asyncsock->error = 0;
 	asyncsock->flags = 0;
+	asyncsock->link = -1;
+	asyncsock->accepted = 0;
+	asyncsock->arate = 0;
+	asyncsock->acount = 0;
+	asyncsock->astamp = 0;
+	asyncsock->expires = 0;
+	asyncsock->wtime = 0;
+	asyncsock->idle = -1;
+	asyncsock->tmconnect = 0;
+	asyncsock->stall = 0;
+	asyncsock->hiwater = 0;
+	asyncsock->lowater = 0;
 	iqueue_init(&asyncsock->node);
-	ims_init(&asyncsock->linemsg, nodes, 0, 0);
+	asyncsock->linemsg = NULL;
+	memset(&asyncsock->stat, 0, sizeof(asyncsock->stat));
+	asyncsock->total = NULL;
 	ims_init(&asyncsock->sendmsg, nodes, 0, 0);
 	ims_init(&asyncsock->recvmsg, nodes, 0, 0);
 }
@@ -243,13 +417,11 @@ void async_sock_destroy(CAsyncSock *asyncsock)
 	asyncsock->error = 0;
 	asyncsock->buffer = NULL;
 	asyncsock->state = ASYNC_SOCK_STATE_CLOSED;
-	ims_destroy(&asyncsock->linemsg);
+	async_sock_line_free(asyncsock);
 	ims_destroy(&asyncsock->sendmsg);
 	ims_destroy(&asyncsock->recvmsg);
-	asyncsock->rc4_send_x = -1;
-	asyncsock->rc4_send_y = -1;
-	asyncsock->rc4_recv_x = -1;
-	asyncsock->rc4_recv_y = -1;
+	async_sock_transform(asyncsock, ASYNC_TRANSFORM_SEND, NULL);
+	async_sock_transform(asyncsock, ASYNC_TRANSFORM_RECV, NULL);
 }
 
 
@@ -261,27 +433,15 @@ int async_sock_connect(CAsyncSock *asyncsock, const struct sockaddr *remote,
 
 	asyncsock->fd = -1;
 	asyncsock->state = ASYNC_SOCK_STATE_CLOSED;
-	asyncsock->header = (header < 0 || header > ITMH_LINESPLIT)? 0 : header;
+	asyncsock->header = (header < 0 || header > ITMH_VARINT)? 0 : header;
 	asyncsock->error = 0;
 
-	ims_clear(&asyncsock->linemsg);
+	async_sock_line_clear(asyncsock);
 	ims_clear(&asyncsock->sendmsg);
 	ims_clear(&asyncsock->recvmsg);
 
-	if (asyncsock->buffer == NULL) {
-		if (asyncsock->external == NULL) {
-			asyncsock->buffer = (char*)ikmem_malloc(ASYNC_SOCK_BUFSIZE);
-			if (asyncsock->buffer == NULL) return -1;
-			asyncsock->bufsize = ASYNC_SOCK_BUFSIZE;
-		}	else {
-			asyncsock->buffer = asyncsock->external;
-		}
-	}
-
-	asyncsock->rc4_send_x = -1;
-	asyncsock->rc4_send_y = -1;
-	asyncsock->rc4_recv_x = -1;
-	asyncsock->rc4_recv_y = -1;
+	async_sock_transform(asyncsock, ASYNC_TRANSFORM_SEND, NULL);
+	async_sock_transform(asyncsock, ASYNC_TRANSFORM_RECV, NULL);
 	
 	if (addrlen <= 20) {
 		asyncsock->fd = isocket(AF_INET, SOCK_STREAM, 0);
@@ -328,24 +488,12 @@ int async_sock_assign(CAsyncSock *asyncsock, int sock, int header)
 {
 	if (asyncsock->fd >= 0) iclose(asyncsock->fd);
 	asyncsock->fd = -1;
-	asyncsock->header = (header < 0 || header > ITMH_LINESPLIT)? 0 : header;
-
-	if (asyncsock->buffer == NULL) {
-		if (asyncsock->external == NULL) {
-			asyncsock->buffer = (char*)ikmem_malloc(ASYNC_SOCK_BUFSIZE);
-			if (asyncsock->buffer == NULL) return -1;
-			asyncsock->bufsize = ASYNC_SOCK_BUFSIZE;
-		}	else {
-			asyncsock->buffer = asyncsock->external;
-		}
-	}
+	asyncsock->header = (header < 0 || header > ITMH_VARINT)? 0 : header;
 
-	asyncsock->rc4_send_x = -1;
-	asyncsock->rc4_send_y = -1;
-	asyncsock->rc4_recv_x = -1;
-	asyncsock->rc4_recv_y = -1;
+	async_sock_transform(asyncsock, ASYNC_TRANSFORM_SEND, NULL);
+	async_sock_transform(asyncsock, ASYNC_TRANSFORM_RECV, NULL);
 
-	ims_clear(&asyncsock->linemsg);
+	async_sock_line_clear(asyncsock);
 	ims_clear(&asyncsock->sendmsg);
 	ims_clear(&asyncsock->recvmsg);
 
@@ -367,10 +515,8 @@ void async_sock_close(CAsyncSock *asyncsock)
 	if (asyncsock->fd >= 0) iclose(asyncsock->fd);
 	asyncsock->fd = -1;
 	asyncsock->state = ASYNC_SOCK_STATE_CLOSED;
-	asyncsock->rc4_send_x = -1;
-	asyncsock->rc4_send_y = -1;
-	asyncsock->rc4_recv_x = -1;
-	asyncsock->rc4_recv_y = -1;
+	async_sock_transform(asyncsock, ASYNC_TRANSFORM_SEND, NULL);
+	async_sock_transform(asyncsock, ASYNC_TRANSFORM_RECV, NULL);
 }
 
 /* try connect */
@@ -397,45 +543,112 @@ static int async_sock_try_connect(CAsyncSock *asyncsock)
 /* try send */
 static int async_sock_try_send(CAsyncSock *asyncsock)
 {
-	void *ptr;
-	char *flat;
-	long size;
-	int retval;
+	void *vecptr[ISOCK_IOVMAX];
+	ilong vecsize[ISOCK_IOVMAX];
+	long veclen[ISOCK_IOVMAX];
+	int count, i;
+	long retval;
 
 	if (asyncsock->state != ASYNC_SOCK_STATE_ESTAB) return 0;
 
 	while (1) {
-		size = ims_flat(&asyncsock->sendmsg, &ptr);
-		if (size <= 0) break;
-		flat = (char*)ptr;
-		retval = isend(asyncsock->fd, flat, size, 0);
+		/* gather all pages of sendmsg into one syscall */
+		count = ims_flatv(&asyncsock->sendmsg, vecptr, vecsize, 
+			ISOCK_IOVMAX);
+		if (count <= 0) break;
+		for (i = 0; i < count; i++) veclen[i] = (long)vecsize[i];
+		if (count == 1) {
+			retval = isend(asyncsock->fd, vecptr[0], veclen[0], 0);
+		}	else {
+			retval = isendv(asyncsock->fd, (const void * const *)vecptr,
+				veclen, count, 0);
+		}
+		ASYNC_SOCK_STAT_ADD(asyncsock, txcalls, 1);
 		if (retval == 0) break;
 		else if (retval < 0) {
 			retval = ierrno();
-			if (retval == IEAGAIN || retval == 0) break;
-			else {
+			if (retval == IEAGAIN || retval == 0) {
+				ASYNC_SOCK_STAT_ADD(asyncsock, txagain, 1);
+				break;
+			}	else {
 				asyncsock->error = retval;
 				return -1;
 			}
 		}
+		ASYNC_SOCK_STAT_ADD(asyncsock, txbytes, retval);
 		ims_drop(&asyncsock->sendmsg, retval);
 	}
+	if (asyncsock->sendmsg.size == 0) {
+		ims_trim(&asyncsock->sendmsg);	/* idle sockets keep no pages */
+	}
 	return 0;
 }
 
-/* try receive */
-static int async_sock_try_recv(CAsyncSock *asyncsock)
+/* receive straight into free space of recvmsg pages, no bounce buffer */
+/* returns -3 if no page can be allocated, otherwise same as irecv    */
+static long async_sock_recv_pages(CAsyncSock *asyncsock, long size)
 {
-	unsigned char *buffer = (unsigned char*)asyncsock->buffer;
-	long bufsize = asyncsock->bufsize;
-	int retval;
+	void *vecptr[ASYNC_SOCK_RECVVEC];
+	ilong vecsize[ASYNC_SOCK_RECVVEC];
+	long veclen[ASYNC_SOCK_RECVVEC];
+	long retval, remain;
+	int count, i;
+	count = ims_reserve(&asyncsock->recvmsg, size, vecptr, vecsize, 
+		ASYNC_SOCK_RECVVEC);
+	if (count <= 0) return -3;
+	for (i = 0; i < count; i++) veclen[i] = (long)vecsize[i];
+	if (count == 1) {
+		retval = irecv(asyncsock->fd, vecptr[0], veclen[0], 0);
+	}	else {
+		retval = irecvv(asyncsock->fd, vecptr, veclen, count, 0);
+	}
+	if (retval <= 0) return retval;
+	if (asyncsock->decoder != NULL) {
+		for (i = 0, remain = retval; i < count && remain > 0; i++) {
+			long chunk = (remain < veclen[i])? remain : veclen[i];
+			async_sock_chain_run(asyncsock->decoder, vecptr[i], 
+				vecptr[i], chunk);
+			remain -= chunk;
+		}
+	}
+	ims_commit(&asyncsock->recvmsg, retval);
+	return retval;
+}
+
+/* try receive: if drain is set, read until EAGAIN (edge-triggered), */
+/* returns 1 if it stopped early and data may still be pending       */
+static int async_sock_try_recv(CAsyncSock *asyncsock, int drain)
+{
+	unsigned char *buffer = NULL;
+	long bufsize = ASYNC_SOCK_BUFSIZE, total = 0;
+	int retval, round = 0;
 	if (asyncsock->state == ASYNC_SOCK_STATE_CLOSED) return 0;
+	if (asyncsock->bufsize > bufsize) {
+		/* capped by RECVVEC pages, unused ones are trimmed by pump */
+		bufsize = asyncsock->bufsize;
+	}
+	if (asyncsock->header == ITMH_LINESPLIT) {
+		buffer = (unsigned char*)async_sock_buffer(asyncsock);
+		if (buffer == NULL) return -2;
+		bufsize = asyncsock->bufsize;
+	}
 	while (1) {
-		retval = irecv(asyncsock->fd, buffer, bufsize, 0);
+		if (asyncsock->header != ITMH_LINESPLIT) {
+			retval = async_sock_recv_pages(asyncsock, bufsize);
+		}	else {
+			retval = irecv(asyncsock->fd, buffer, bufsize, 0);
+		}
+		ASYNC_SOCK_STAT_ADD(asyncsock, rxcalls, 1);
+		if (retval == -3 && asyncsock->header != ITMH_LINESPLIT) {
+			asyncsock->error = ENOMEM;	/* out of memory: close it */
+			return -2;
+		}
 		if (retval < 0) {
 			retval = ierrno();
-			if (retval == IEAGAIN || retval == 0) break;
-			else { 
+			if (retval == IEAGAIN || retval == 0) {
+				ASYNC_SOCK_STAT_ADD(asyncsock, rxagain, 1);
+				break;
+			}	else { 
 				asyncsock->error = retval;
 				return -2;
 			}
@@ -444,37 +657,67 @@ static int async_sock_try_recv(CAsyncSock *asyncsock)
 			asyncsock->error = 0;
 			return -1;
 		}
-		if (asyncsock->rc4_recv_x >= 0 && asyncsock->rc4_recv_y >= 0) {
-			icrypt_rc4_crypt(asyncsock->rc4_recv_box, &asyncsock->rc4_recv_x,
-				&asyncsock->rc4_recv_y, buffer, buffer, retval);
-		}
+		ASYNC_SOCK_STAT_ADD(asyncsock, rxbytes, retval);
 		if (asyncsock->header != ITMH_LINESPLIT) {
-			ims_write(&asyncsock->recvmsg, buffer, retval);
+			/* already decoded and committed into recvmsg */
 		}	else {
-			long start = 0, pos = 0;
+			struct IMSTREAM *linemsg = asyncsock->linemsg;
+			ilong ends[ASYNC_SOCK_LINES];
+			long start = 0;
 			char head[4];
-			for (start = 0, pos = 0; pos < retval; pos++) {
-				if (buffer[pos] == '\n') {
-					long x = pos - start + 1;
-					long y = asyncsock->linemsg.size;
-					iencode32u_lsb(head, x + y + 4);
+			if (asyncsock->decoder != NULL) {
+				async_sock_chain_run(asyncsock->decoder, buffer, buffer, 
+					retval);
+			}
+			while (start < retval) {
+				const char *text = (const char*)buffer + start;
+				ilong count, i;
+				count = istrlines(text, retval - start, ends, 
+					ASYNC_SOCK_LINES);
+				if (count == 0) break;
+				if (linemsg != NULL && linemsg->size > 0) {
+					/* first line completes the pending partial one */
+					long y = (long)linemsg->size;
+					iencode32u_lsb(head, (IUINT32)(ends[0] + y + 4));
 					ims_write(&asyncsock->recvmsg, head, 4);
-					while (asyncsock->linemsg.size > 0) {
+					while (y > 0) {
 						ilong csize;
 						void *ptr;
-						csize = ims_flat(&asyncsock->linemsg, &ptr);
+						csize = ims_flat(linemsg, &ptr);
 						ims_write(&asyncsock->recvmsg, ptr, csize);
-						ims_drop(&asyncsock->linemsg, csize);
+						ims_drop(linemsg, csize);
+						y -= (long)csize;
 					}
-					ims_write(&asyncsock->recvmsg, &buffer[start], x);
-					start = pos + 1;
+					ims_write(&asyncsock->recvmsg, text, ends[0]);
+					ims_trim(linemsg);
+					i = 1;
+				}	else {
+					i = 0;
+				}
+				for (; i < count; i++) {
+					ilong from = (i > 0)? ends[i - 1] : 0;
+					iencode32u_lsb(head, (IUINT32)(ends[i] - from + 4));
+					ims_write(&asyncsock->recvmsg, head, 4);
+					ims_write(&asyncsock->recvmsg, text + from, 
+						ends[i] - from);
 				}
+				start += (long)ends[count - 1];
 			}
-			if (pos > start) {
-				ims_write(&asyncsock->linemsg, &buffer[start], pos - start);
+			if (start < retval) {
+				linemsg = async_sock_line(asyncsock);
+				if (linemsg == NULL) return -2;
+				ims_write(linemsg, &buffer[start], retval - start);
 			}
 		}
-		if (retval < bufsize) break;
+		/* level-triggered: one read per readiness, poll reports the */
+		/* rest again, looping would pile the stream up in recvmsg  */
+		if (drain == 0) break;
+		total += retval;
+		if (++round >= ASYNC_SOCK_DRAIN || 
+			total >= ASYNC_SOCK_DRAIN * ASYNC_SOCK_BUFSIZE ||
+			asyncsock->recvmsg.size >= (iulong)asyncsock->maxsize) {
+			return 1;
+		}
 	}
 	return 0;
 }
@@ -482,10 +725,11 @@ static int async_sock_try_recv(CAsyncSock *asyncsock)
 /* update */
 int async_sock_update(CAsyncSock *asyncsock, int what)
 {
-	int hr = 0;
+	int hr = 0, more = 0;
 	if (what & 1) {
-		hr = async_sock_try_recv(asyncsock);
-		if (hr != 0) return hr;
+		hr = async_sock_try_recv(asyncsock, (what & 8)? 1 : 0);
+		if (hr < 0) return hr;
+		more = hr;
 	}
 	if (what & 2) {
 		hr = async_sock_try_send(asyncsock);
@@ -495,7 +739,7 @@ int async_sock_update(CAsyncSock *asyncsock, int what)
 		hr = async_sock_try_connect(asyncsock);
 		if (hr != 0) return hr;
 	}
-	return 0;
+	return more;
 }
 
 /* process */
@@ -513,7 +757,7 @@ void async_sock_process(CAsyncSock *asyncsock)
 				async_sock_close(asyncsock);
 				return;
 			}
-			if (async_sock_try_recv(asyncsock) != 0) {
+			if (async_sock_try_recv(asyncsock, 0) != 0) {
 				async_sock_close(asyncsock);
 				return;
 			}
@@ -540,17 +784,45 @@ long async_sock_remain(const CAsyncSock *asyncsock)
 }
 
 
-/* header size */
-static const int async_sock_head_len[15] = 
-	{ 2, 2, 4, 4, 1, 1, 2, 2, 4, 4, 1, 1, 4, 0, 4 };
+/* header size, varint (last one) is decided per packet */
+static const int async_sock_head_len[16] = 
+	{ 2, 2, 4, 4, 1, 1, 2, 2, 4, 4, 1, 1, 4, 0, 4, 0 };
 
 /* header increasement */
-static const int async_sock_head_inc[15] = 
-	{ 0, 0, 0, 0, 0, 0, 2, 2, 4, 4, 1, 1, 0, 0, 0 };
+static const int async_sock_head_inc[16] = 
+	{ 0, 0, 0, 0, 0, 0, 2, 2, 4, 4, 1, 1, 0, 0, 0, 0 };
+
+/* peek varint size: returns packet size including header, 0 for not
+ * enough data, 0xffffffff for a malformed or oversized header */
+static inline IUINT32
+async_sock_read_varint(const CAsyncSock *asyncsock, int *hdrlen)
+{
+	unsigned char dsize[ASYNC_SOCK_HEADMAX];
+	IUINT64 value;
+	int size, i;
+
+	size = (int)ims_peek(&asyncsock->recvmsg, dsize, ASYNC_SOCK_VARINT);
+
+	for (i = 0; i < size; i++) {
+		if ((dsize[i] & 0x80) == 0) break;
+	}
+
+	if (i >= size) {
+		return (size < ASYNC_SOCK_VARINT)? 0 : 0xffffffff;
+	}
+
+	idecodeu((const char*)dsize, &value);
+
+	if (value >= 0x7fffffff - ASYNC_SOCK_VARINT) return 0xffffffff;
+
+	hdrlen[0] = i + 1;
+
+	return (IUINT32)value + i + 1;
+}
 
-/* peek size */
+/* peek size: returns packet size including header */
 static inline IUINT32
-async_sock_read_size(const CAsyncSock *asyncsock)
+async_sock_read_size(const CAsyncSock *asyncsock, int *headlen)
 {
 	unsigned char dsize[4];
 	IUINT32 len;
@@ -563,9 +835,15 @@ async_sock_read_size(const CAsyncSock *asyncsock)
 
 	assert(asyncsock);
 
+	if (asyncsock->header == ITMH_VARINT) {
+		return async_sock_read_varint(asyncsock, headlen);
+	}
+
 	hdrlen = async_sock_head_len[asyncsock->header];
 	hdrinc = async_sock_head_inc[asyncsock->header];
 
+	headlen[0] = hdrlen;
+
 	if (asyncsock->header == ITMH_RAWDATA) {
 		len = (unsigned long)asyncsock->recvmsg.size;
 		if (len > ASYNC_SOCK_BUFSIZE) return ASYNC_SOCK_BUFSIZE;
@@ -633,6 +911,10 @@ async_sock_write_size(const CAsyncSock *asyncsock, long size,
 
 	assert(asyncsock);
 
+	if (asyncsock->header == ITMH_VARINT) {
+		return (int)(iencodeu(out, (IUINT64)size) - out);
+	}
+
 	if (asyncsock->header >= ITMH_RAWDATA) return 0;
 
 	hdrlen = async_sock_head_len[asyncsock->header];
@@ -671,12 +953,47 @@ async_sock_write_size(const CAsyncSock *asyncsock, long size,
 	return hdrlen;
 }
 
+/* encode straight into free space of sendmsg pages, no bounce buffer */
+static void async_sock_write_encoded(CAsyncSock *asyncsock, 
+	const void *ptr, long size)
+{
+	const char *lptr = (const char*)ptr;
+	while (size > 0) {
+		void *vecptr[ASYNC_SOCK_RECVVEC];
+		ilong vecsize[ASYNC_SOCK_RECVVEC];
+		long total = 0;
+		int count, i;
+		count = ims_reserve(&asyncsock->sendmsg, size, vecptr, vecsize,
+			ASYNC_SOCK_RECVVEC);
+		if (count <= 0) break;
+		for (i = 0; i < count && size > 0; i++) {
+			long chunk = (size < (long)vecsize[i])? size : (long)vecsize[i];
+			async_sock_chain_run(asyncsock->encoder, lptr, vecptr[i], chunk);
+			lptr += chunk;
+			size -= chunk;
+			total += chunk;
+		}
+		ims_commit(&asyncsock->sendmsg, total);
+	}
+}
+
+/* count a queued message and track the peak of the send queue */
+static inline void async_sock_queued(CAsyncSock *asyncsock)
+{
+	IINT64 size = (IINT64)asyncsock->sendmsg.size;
+	ASYNC_SOCK_STAT_ADD(asyncsock, txmsgs, 1);
+	if (size > asyncsock->stat.sendmax) asyncsock->stat.sendmax = size;
+	if (asyncsock->total && size > asyncsock->total->sendmax) {
+		asyncsock->total->sendmax = size;
+	}
+}
+
 /* send vector */
 long async_sock_send_vector(CAsyncSock *asyncsock, 
 	const void * const vecptr[],
 	const long veclen[], int count, int mask)
 {
-	unsigned char head[4];
+	unsigned char head[ASYNC_SOCK_HEADMAX];
 	long size = 0;
 	int hdrlen;
 	int i;
@@ -687,37 +1004,66 @@ long async_sock_send_vector(CAsyncSock *asyncsock,
 	for (i = 0; i < count; i++) size += veclen[i];
 	hdrlen = async_sock_write_size(asyncsock, size, mask, (char*)head);
 
-	if (asyncsock->rc4_send_x >= 0 && asyncsock->rc4_send_y >= 0 && hdrlen) {
-		icrypt_rc4_crypt(asyncsock->rc4_send_box, &asyncsock->rc4_send_x,
-			&asyncsock->rc4_send_y, head, head, hdrlen);
-	}
-
-	ims_write(&asyncsock->sendmsg, head, hdrlen);
-
-	for (i = 0; i < count; i++) {
-		if (asyncsock->rc4_send_x < 0 || asyncsock->rc4_send_y < 0) {
+	if (asyncsock->encoder == NULL) {
+		ims_write(&asyncsock->sendmsg, head, hdrlen);
+		for (i = 0; i < count; i++) {
 			ims_write(&asyncsock->sendmsg, vecptr[i], veclen[i]);
-		}	else {
-			unsigned char *buffer = (unsigned char*)asyncsock->buffer;
-			const unsigned char *lptr = (const unsigned char*)vecptr[i];
-			long remain = veclen[i];
-			long bufsize = asyncsock->bufsize;
-			for (; remain > 0; ) {
-				long canread = (size > bufsize)? bufsize : remain;
-				icrypt_rc4_crypt(asyncsock->rc4_send_box, 
-					&asyncsock->rc4_send_x, 
-					&asyncsock->rc4_send_y, 
-					lptr, buffer, canread);
-				ims_write(&asyncsock->sendmsg, buffer, canread);
-				remain -= canread;
-				lptr += canread;
-			}
+		}
+	}	else {
+		async_sock_write_encoded(asyncsock, head, hdrlen);
+		for (i = 0; i < count; i++) {
+			async_sock_write_encoded(asyncsock, vecptr[i], veclen[i]);
 		}
 	}
 
+	async_sock_queued(asyncsock);
+
 	return size;
 }
 
+/* send shared buffer after offset, the header is linked too when the
+ * bytes right before offset equal it, copied when a transform is set */
+long async_sock_send_shared(CAsyncSock *asyncsock, struct IMSHARED *shared,
+	long offset, int mask)
+{
+	const void *vecptr[1];
+	long veclen[1];
+	char head[ASYNC_SOCK_HEADMAX];
+	int hdrlen;
+
+	assert(asyncsock && shared);
+	if (offset < 0 || offset > (long)shared->size) return -1;
+
+	vecptr[0] = shared->data + offset;
+	veclen[0] = (long)shared->size - offset;
+
+	if (asyncsock->encoder != NULL) {
+		return async_sock_send_vector(asyncsock, vecptr, veclen, 1, mask);
+	}
+
+	hdrlen = async_sock_write_size(asyncsock, veclen[0], mask, head);
+
+	if (hdrlen <= offset && 
+		memcmp(shared->data + offset - hdrlen, head, hdrlen) == 0) {
+		if (ims_write_shared(&asyncsock->sendmsg, shared, 
+			offset - hdrlen, veclen[0] + hdrlen) < 0) 
+			return async_sock_send_vector(asyncsock, vecptr, veclen, 
+				1, mask);
+		async_sock_queued(asyncsock);
+		return veclen[0];
+	}
+
+	ims_write(&asyncsock->sendmsg, head, hdrlen);
+	if (ims_write_shared(&asyncsock->sendmsg, shared, offset, 
+		veclen[0]) < 0) {
+		ims_write(&asyncsock->sendmsg, vecptr[0], veclen[0]);
+	}
+
+	async_sock_queued(asyncsock);
+
+	return veclen[0];
+}
+
 /**
  * recv vector: returns packet size, -1 for not enough data, -2 for 
  * buffer size too small, -3 for packet size error, -4 for size over limit,
@@ -728,15 +1074,16 @@ long async_sock_recv_vector(CAsyncSock *asyncsock, void* const vecptr[],
 {
 	long hdrlen, remain, size = 0;
 	IUINT32 len;
+	int headlen = 0;
 	int i;
 
 	assert(asyncsock);
 	if (asyncsock == 0) return 0;
 
-	hdrlen = async_sock_head_len[asyncsock->header];
 	for (i = 0; i < count; i++) size += veclen[i];
 
-	len = async_sock_read_size(asyncsock);
+	len = async_sock_read_size(asyncsock, &headlen);
+	hdrlen = headlen;
 	if (len <= 0) return -1;
 	if ((long)len < hdrlen) return -3;
 	if ((long)len > asyncsock->maxsize) return -4;
@@ -757,6 +1104,8 @@ long async_sock_recv_vector(CAsyncSock *asyncsock, void* const vecptr[],
 		remain -= canread;
 	}
 
+	ASYNC_SOCK_STAT_ADD(asyncsock, rxmsgs, 1);
+
 	return len;
 }
 
@@ -796,18 +1145,14 @@ long async_sock_recv(CAsyncSock *asyncsock, void *ptr, int size)
 void async_sock_rc4_set_skey(CAsyncSock *asyncsock, 
 	const unsigned char *key, int keylen)
 {
-	icrypt_rc4_init(asyncsock->rc4_send_box, 
-			&asyncsock->rc4_send_x,
-			&asyncsock->rc4_send_y, key, keylen);
+	async_sock_rc4_key(&asyncsock->encoder, key, keylen);
 }
 
 /* set recv cryption key */
 void async_sock_rc4_set_rkey(CAsyncSock *asyncsock, 
 	const unsigned char *key, int keylen)
 {
-	icrypt_rc4_init(asyncsock->rc4_recv_box, 
-			&asyncsock->rc4_recv_x,
-			&asyncsock->rc4_recv_y, key, keylen);
+	async_sock_rc4_key(&asyncsock->decoder, key, keylen);
 }
 
 /* set nodelay */
@@ -842,12 +1187,53 @@ int async_sock_keepalive(CAsyncSock *asyncsock, int keepcnt, int keepidle,
 /*===================================================================*/
 /* CAsyncCore                                                        */
 /*===================================================================*/
+
+/* events encoded by one producer, published to the reader at once */
+struct CAsyncBatch
+{
+	struct CAsyncBatch *next;
+	long size;
+	long capacity;
+	long reserved;
+	IINT64 stamp;		/* usec of the first record, 0 if not sampled */
+};
+
+/* event record in a batch, followed by payload (8 bytes aligned) */
+struct CAsyncRecord
+{
+	long length;
+	long event;
+	long wparam;
+	long lparam;
+};
+
+/* hierarchical timing wheel in milliseconds: 256 + 4 x 64 slots */
+#define ASYNC_WHEEL_ROOT_BITS	8
+#define ASYNC_WHEEL_NODE_BITS	6
+#define ASYNC_WHEEL_ROOT_SIZE	(1 << ASYNC_WHEEL_ROOT_BITS)
+#define ASYNC_WHEEL_NODE_SIZE	(1 << ASYNC_WHEEL_NODE_BITS)
+#define ASYNC_WHEEL_ROOT_MASK	(ASYNC_WHEEL_ROOT_SIZE - 1)
+#define ASYNC_WHEEL_NODE_MASK	(ASYNC_WHEEL_NODE_SIZE - 1)
+
+struct CAsyncWheel
+{
+	IUINT32 jiffies;
+	long count;
+	struct IQUEUEHEAD root[ASYNC_WHEEL_ROOT_SIZE];
+	struct IQUEUEHEAD node[4][ASYNC_WHEEL_NODE_SIZE];
+};
+
 struct CAsyncCore
 {
 	struct IMEMNODE *nodes;
 	struct IMEMNODE *cache;
-	struct IMSTREAM msgs;
-	struct IQUEUEHEAD head;
+	struct CAsyncBatch *batch;
+	struct CAsyncBatch * volatile stack;
+	struct CAsyncBatch *rhead;
+	struct CAsyncBatch *rtail;
+	struct CAsyncBatch *rdone;
+	long rpos;
+	struct CAsyncWheel wheel;
 	struct IVECTOR *vector;
 	ipolld pfd;
 	long bufsize;
@@ -859,16 +1245,35 @@ struct CAsyncCore
 	long msgcnt;
 	long count;
 	long index;
+	long imask;
 	int xfd[3];
 	int nolock;
+	int edge;
 	int flags;
 	IMUTEX_TYPE lock;
 	IMUTEX_TYPE xmtx;
 	IMUTEX_TYPE xmsg;
+	IMUTEX_TYPE gate;
 	IUINT32 current;
-	IUINT32 lastsec;
 	IUINT32 timeout;
+	long spin;
+	long busypoll;
 	CAsyncValidator validator;
+	struct CAsyncStat stat;
+	struct CAsyncHist *hist;
+	struct CAsyncCore *master;
+	struct CAsyncCore **shards;
+	struct IMSTREAM inbox;
+	struct IMSTREAM flush;
+	struct IQUEUEHEAD listens;
+	iPosixThread *thread;
+	int nshards;
+	int shard;
+	int sbits;
+	int rotate;
+	volatile int xwait;
+	volatile int xdirty;
+	volatile int stop;
 };
 
 
@@ -881,61 +1286,258 @@ struct CAsyncCore
 
 #define ASYNC_CORE_FLAG_PROGRESS	1
 #define ASYNC_CORE_FLAG_SENSITIVE	2
+#define ASYNC_CORE_FLAG_FANOUT		4
+#define ASYNC_CORE_FLAG_TIMER		8
+#define ASYNC_CORE_FLAG_HIGHWATER	16
+#define ASYNC_CORE_FLAG_HISTOGRAM	32	/* core->flags: sampling on */
+#define ASYNC_CORE_FLAG_RXMORE		64	/* edge: read yielded early */
+
+/* hid layout: serial(15) | index(16), in sharded mode the top sbits */
+/* of index hold the shard id, sbits = bits of nshards (at most 4)   */
+#define ASYNC_CORE_SHARD_BITS		4
+#define ASYNC_CORE_SHARD_MAX		(1 << ASYNC_CORE_SHARD_BITS)
+
+#ifndef ASYNC_CORE_SHARD_WAIT
+#define ASYNC_CORE_SHARD_WAIT		100
+#endif
+
+/* poll results fetched at once by async_core_process_events */
+#ifndef ASYNC_CORE_EVENTS
+#define ASYNC_CORE_EVENTS			64
+#endif
 
 /* used to monitor self-pipe trick */
 static unsigned int async_core_monitor = 0; 
 
 #define ASYNC_CORE_CRITICAL_BEGIN(c)	\
-    do { if ((c)->nolock == 0) IMUTEX_LOCK(&((c)->lock)); } while (0)
+    do { if ((c)->nolock == 0) async_core_enter((CAsyncCore*)(c)); } while (0)
 
 #define ASYNC_CORE_CRITICAL_END(c)	\
-    do { if ((c)->nolock == 0) IMUTEX_UNLOCK(&((c)->lock)); } while (0)
+    do { if ((c)->batch) async_core_msg_publish((CAsyncCore*)(c)); \
+		if ((c)->nolock == 0) IMUTEX_UNLOCK(&((c)->lock)); } while (0)
+
+static void async_core_msg_publish(CAsyncCore *core);
+
+
+/* accepted socket handed over to another shard */
+struct CAsyncHandoff
+{
+	int fd;
+	int header;
+	int addrlen;
+	long listen_hid;
+	long limited;
+	long maxsize;
+	char remote[64];
+};
 
 
 static long _async_core_node_head(const CAsyncCore *core);
 static long _async_core_node_next(const CAsyncCore *core, long hid);
 static long _async_core_node_prev(const CAsyncCore *core, long hid);
+static int async_core_shard_run(void *obj);
+static void async_core_node_timer(CAsyncCore *core, CAsyncSock *sock);
+static int async_core_msg_push(CAsyncCore *core, int event, long wparam, 
+	long lparam, const void *data, long size);
+static void async_core_event_close(CAsyncCore *core, 
+	CAsyncSock *sock, int code);
+
 
 /*-------------------------------------------------------------------*/
-/* new async core                                                    */
+/* timing wheel: init                                                */
 /*-------------------------------------------------------------------*/
-CAsyncCore* async_core_new(int flags)
+static void async_core_wheel_init(struct CAsyncWheel *wheel, IUINT32 now)
 {
-	CAsyncCore *core;
-
-	core = (CAsyncCore*)ikmem_malloc(sizeof(CAsyncCore));
-	if (core == NULL) return NULL;
+	int i, j;
+	wheel->jiffies = now;
+	wheel->count = 0;
+	for (i = 0; i < ASYNC_WHEEL_ROOT_SIZE; i++) {
+		iqueue_init(&wheel->root[i]);
+	}
+	for (i = 0; i < 4; i++) {
+		for (j = 0; j < ASYNC_WHEEL_NODE_SIZE; j++) {
+			iqueue_init(&wheel->node[i][j]);
+		}
+	}
+}
 
-	memset(core, 0, sizeof(CAsyncCore));
+/*-------------------------------------------------------------------*/
+/* timing wheel: link node into the slot of sock->expires            */
+/*-------------------------------------------------------------------*/
+static void async_core_wheel_link(struct CAsyncWheel *wheel, 
+	CAsyncSock *sock)
+{
+	IUINT32 expires = sock->expires;
+	IUINT32 idx = expires - wheel->jiffies;
+	struct IQUEUEHEAD *vec;
+	if ((IINT32)idx < 0) {
+		vec = &wheel->root[wheel->jiffies & ASYNC_WHEEL_ROOT_MASK];
+	}
+	else if (idx < ASYNC_WHEEL_ROOT_SIZE) {
+		vec = &wheel->root[expires & ASYNC_WHEEL_ROOT_MASK];
+	}
+	else {
+		int level, shift;
+		for (level = 0; level < 3; level++) {
+			shift = ASYNC_WHEEL_ROOT_BITS + (level + 1) * 
+				ASYNC_WHEEL_NODE_BITS;
+			if (idx < ((IUINT32)1 << shift)) break;
+		}
+		shift = ASYNC_WHEEL_ROOT_BITS + level * ASYNC_WHEEL_NODE_BITS;
+		vec = &wheel->node[level][(expires >> shift) & 
+			ASYNC_WHEEL_NODE_MASK];
+	}
+	iqueue_add_tail(&sock->node, vec);
+}
 
-	core->nodes = imnode_create(sizeof(CAsyncSock), 64);
-	core->cache = imnode_create(8192, 64);
-	core->vector = iv_create();
+/*-------------------------------------------------------------------*/
+/* timing wheel: move nodes of an outer slot down                    */
+/*-------------------------------------------------------------------*/
+static int async_core_wheel_cascade(struct CAsyncWheel *wheel, 
+	int level, int index)
+{
+	struct IQUEUEHEAD queue;
+	iqueue_init(&queue);
+	iqueue_splice_init(&wheel->node[level][index], &queue);
+	while (!iqueue_is_empty(&queue)) {
+		CAsyncSock *sock = iqueue_entry(queue.next, CAsyncSock, node);
+		iqueue_del(&sock->node);
+		async_core_wheel_link(wheel, sock);
+	}
+	return index;
+}
 
-	assert(core->nodes && core->cache);
+/*-------------------------------------------------------------------*/
+/* timing wheel: collect nodes expired until now                     */
+/*-------------------------------------------------------------------*/
+static void async_core_wheel_run(struct CAsyncWheel *wheel, IUINT32 now,
+	struct IQUEUEHEAD *expired)
+{
+	while ((IINT32)(now - wheel->jiffies) >= 0) {
+		int index = (int)(wheel->jiffies & ASYNC_WHEEL_ROOT_MASK);
+		if (index == 0) {
+			int level, shift, n;
+			for (level = 0; level < 4; level++) {
+				shift = ASYNC_WHEEL_ROOT_BITS + level * ASYNC_WHEEL_NODE_BITS;
+				n = (int)((wheel->jiffies >> shift) & ASYNC_WHEEL_NODE_MASK);
+				if (async_core_wheel_cascade(wheel, level, n) != 0) break;
+			}
+		}
+		iqueue_splice_init(&wheel->root[index], expired);
+		wheel->jiffies++;
+	}
+}
 
-	if (core->nodes == NULL || core->cache == NULL ||
-		core->vector == NULL) {
-		if (core->nodes) imnode_delete(core->nodes);
-		if (core->cache) imnode_delete(core->cache);
-		if (core->vector) iv_delete(core->vector);
-		memset(core, 0, sizeof(CAsyncCore));
-		ikmem_free(core);
-		return NULL;
+/*-------------------------------------------------------------------*/
+/* timing wheel: how long to poll before the next slot is due        */
+/*-------------------------------------------------------------------*/
+static IUINT32 async_core_wheel_wait(const struct CAsyncWheel *wheel, 
+	IUINT32 now, IUINT32 millisec)
+{
+	IUINT32 jiffies = wheel->jiffies, limit, k;
+	if (wheel->count == 0 || millisec == 0) return millisec;
+	if ((IINT32)(jiffies - now) <= 0) return 0;
+	/* outer levels cascade when the root slot wraps around */
+	limit = ASYNC_WHEEL_ROOT_SIZE - (jiffies & ASYNC_WHEEL_ROOT_MASK);
+	for (k = 0; k < limit; k++) {
+		IUINT32 wait = jiffies + k - now;
+		if (wait >= millisec) return millisec;
+		if (!iqueue_is_empty(&wheel->root[(jiffies + k) & 
+			ASYNC_WHEEL_ROOT_MASK])) 
+			return wait;
 	}
+	k = jiffies + limit - now;
+	return (k < millisec)? k : millisec;
+}
 
-	core->bufsize = 0x400000;
 
-	if (iv_resize(core->vector, (core->bufsize + 64) * 2) != 0) {
-		imnode_delete(core->nodes);
-		imnode_delete(core->cache);
-		iv_delete(core->vector);
-		memset(core, 0, sizeof(CAsyncCore));
-		ikmem_free(core);
+/*-------------------------------------------------------------------*/
+/* lock core, wake the shard thread up if it is blocking in poll     */
+/*-------------------------------------------------------------------*/
+static void async_core_enter(CAsyncCore *core)
+{
+	if (core->shard < 0) {
+		IMUTEX_LOCK(&core->lock);
+		return;
+	}
+	IMUTEX_LOCK(&core->xmtx);
+	core->xwait++;
+	IMUTEX_UNLOCK(&core->xmtx);
+	async_core_notify(core);
+	/* the gate keeps the shard thread from re-taking the lock first */
+	IMUTEX_LOCK(&core->gate);
+	IMUTEX_LOCK(&core->lock);
+	IMUTEX_UNLOCK(&core->gate);
+	IMUTEX_LOCK(&core->xmtx);
+	core->xwait--;
+	IMUTEX_UNLOCK(&core->xmtx);
+}
+
+/*-------------------------------------------------------------------*/
+/* sharded mode: find the reactor which owns the hid                 */
+/*-------------------------------------------------------------------*/
+static inline CAsyncCore* async_core_route(const CAsyncCore *core, long hid)
+{
+	int id;
+	if (core->nshards == 0) return (CAsyncCore*)core;
+	id = (int)((hid & 0xffff) >> (16 - core->sbits));
+	return core->shards[id % core->nshards];
+}
+
+/*-------------------------------------------------------------------*/
+/* sharded mode: pick a reactor for a new connection (round-robin)   */
+/*-------------------------------------------------------------------*/
+static CAsyncCore* async_core_pick(CAsyncCore *core)
+{
+	int id;
+	if (core->nshards == 0) return core;
+	IMUTEX_LOCK(&core->xmtx);
+	id = core->rotate;
+	core->rotate = (core->rotate + 1) % core->nshards;
+	IMUTEX_UNLOCK(&core->xmtx);
+	return core->shards[id];
+}
+
+/*-------------------------------------------------------------------*/
+/* create a single reactor                                           */
+/*-------------------------------------------------------------------*/
+static CAsyncCore* async_core_create(int flags)
+{
+	CAsyncCore *core;
+
+	core = (CAsyncCore*)ikmem_malloc(sizeof(CAsyncCore));
+	if (core == NULL) return NULL;
+
+	memset(core, 0, sizeof(CAsyncCore));
+
+	core->nodes = imnode_create(sizeof(CAsyncSock), 64);
+	core->cache = imnode_create(8192, 64);
+	core->vector = iv_create();
+
+	assert(core->nodes && core->cache);
+
+	if (core->nodes == NULL || core->cache == NULL ||
+		core->vector == NULL) {
+		if (core->nodes) imnode_delete(core->nodes);
+		if (core->cache) imnode_delete(core->cache);
+		if (core->vector) iv_delete(core->vector);
+		memset(core, 0, sizeof(CAsyncCore));
+		ikmem_free(core);
 		return NULL;
 	}
 
-	if (ipoll_create(&core->pfd, 20000) != 0) {
+	core->bufsize = 0x400000;
+
+	if (iv_resize(core->vector, (core->bufsize + 64) * 2) != 0) {
+		imnode_delete(core->nodes);
+		imnode_delete(core->cache);
+		iv_delete(core->vector);
+		memset(core, 0, sizeof(CAsyncCore));
+		ikmem_free(core);
+		return NULL;
+	}
+
+	if (ipoll_create(&core->pfd, 20000 | ((flags & 4)? IPOLL_EDGE : 0))) {
 		imnode_delete(core->nodes);
 		imnode_delete(core->cache);
 		iv_delete(core->vector);
@@ -944,23 +1546,45 @@ CAsyncCore* async_core_new(int flags)
 		return NULL;
 	}
 
-	ims_init(&core->msgs, core->cache, 0, 0);
-	iqueue_init(&core->head);
+	core->batch = NULL;
+	core->stack = NULL;
+	core->rhead = NULL;
+	core->rtail = NULL;
+	core->rdone = NULL;
+	core->rpos = 0;
+	iqueue_init(&core->listens);
 
 	core->data = NULL;
 	core->msgcnt = 0;
 	core->count = 0;
 	core->timeout = 0;
+	core->spin = 0;
+	core->busypoll = 0;
 	core->index = 1;
 	core->validator = NULL;
 	core->user = NULL;
 	core->data = (char*)core->vector->data;
 	core->buffer = core->data + core->bufsize + 64;
 	core->current = iclock();
-	core->lastsec = 0;
+	async_core_wheel_init(&core->wheel, core->current);
 	core->maxsize = ASYNC_SOCK_MAXSIZE;
 	core->limited = 0;
 	core->flags = 0;
+	core->hist = NULL;
+	core->master = core;
+	core->shards = NULL;
+	core->thread = NULL;
+	core->nshards = 0;
+	core->shard = -1;
+	core->sbits = 0;
+	core->imask = 0xffff;
+	core->rotate = 0;
+	core->xwait = 0;
+	core->xdirty = 0;
+	core->stop = 0;
+
+	ims_init(&core->inbox, NULL, 0, 0);
+	ims_init(&core->flush, NULL, 0, 0);
 
 	core->xfd[0] = -1;
 	core->xfd[1] = -1;
@@ -969,16 +1593,23 @@ CAsyncCore* async_core_new(int flags)
 	IMUTEX_INIT(&core->lock);
 	IMUTEX_INIT(&core->xmtx);
 	IMUTEX_INIT(&core->xmsg);
+	IMUTEX_INIT(&core->gate);
 	
 	core->nolock = ((flags & 1) == 0)? 0 : 1;
+	core->edge = ipoll_edge(core->pfd);
 
-	/* self-pipe trick */
+	/* self-pipe trick, one eventfd for both ends if available */
 	if ((flags & 2) == 0) {
 	#ifdef __unix
+		#ifdef ASYNC_CORE_EVENTFD
+		core->xfd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		core->xfd[1] = core->xfd[0];
+		#endif
 		#ifndef __AVM2__
-		pipe(core->xfd);
-		ienable(core->xfd[0], ISOCK_NOBLOCK);
-		ienable(core->xfd[1], ISOCK_NOBLOCK);
+		if (core->xfd[0] < 0 && pipe(core->xfd) == 0) {
+			ienable(core->xfd[0], ISOCK_NOBLOCK);
+			ienable(core->xfd[1], ISOCK_NOBLOCK);
+		}
 		#endif
 	#else
 		if (inet_socketpair(core->xfd) != 0) {
@@ -1011,22 +1642,114 @@ CAsyncCore* async_core_new(int flags)
 }
 
 
+/*-------------------------------------------------------------------*/
+/* new async core                                                    */
+/*-------------------------------------------------------------------*/
+CAsyncCore* async_core_new(int flags)
+{
+	CAsyncCore *core;
+	int nshards = (flags >> 8) & 0xff;
+	int i;
+
+	if (nshards <= 1) {
+		return async_core_create(flags & 0xff);
+	}
+
+	if (nshards > ASYNC_CORE_SHARD_MAX) {
+		nshards = ASYNC_CORE_SHARD_MAX;
+	}
+
+	/* shards are driven by their own threads: lock and notify required */
+	core = async_core_create(flags & 0xfc);
+	if (core == NULL) return NULL;
+
+	core->shards = (CAsyncCore**)ikmem_malloc(sizeof(CAsyncCore*) * nshards);
+	if (core->shards == NULL) {
+		async_core_delete(core);
+		return NULL;
+	}
+
+	/* shard id is taken from the index field, the serial stays intact */
+	while ((1 << core->sbits) < nshards) core->sbits++;
+
+	for (i = 0; i < nshards; i++) {
+		CAsyncCore *shard = async_core_create(flags & 0xfc);
+		if (shard == NULL) break;
+		shard->master = core;
+		shard->shard = i;
+		shard->sbits = core->sbits;
+		shard->imask = 0xffff >> core->sbits;
+		shard->rotate = i;
+		core->shards[i] = shard;
+		core->nshards++;
+		shard->thread = iposix_thread_new(async_core_shard_run, shard,
+			"CAsyncCore");
+		if (shard->thread == NULL) break;
+	}
+
+	if (i < nshards) {
+		async_core_delete(core);
+		return NULL;
+	}
+
+	for (i = 0; i < nshards; i++) {
+		if (iposix_thread_start(core->shards[i]->thread) != 0) {
+			async_core_delete(core);
+			return NULL;
+		}
+	}
+
+	return core;
+}
+
+
 /*-------------------------------------------------------------------*/
 /* delete async core                                                 */
 /*-------------------------------------------------------------------*/
 static long async_core_node_delete(CAsyncCore *core, long hid);
+static void async_core_msg_destroy(CAsyncCore *core);
 
 void async_core_delete(CAsyncCore *core)
 {
 	if (core == NULL) return;
+	if (core->shards) {
+		int i;
+		for (i = 0; i < core->nshards; i++) {
+			CAsyncCore *shard = core->shards[i];
+			shard->stop = 1;
+			if (shard->thread) {
+				iposix_thread_set_notalive(shard->thread);
+				async_core_notify(shard);
+			}
+		}
+		for (i = 0; i < core->nshards; i++) {
+			CAsyncCore *shard = core->shards[i];
+			if (shard->thread) {
+				iposix_thread_join(shard->thread, IEVENT_INFINITE);
+				iposix_thread_delete(shard->thread);
+				shard->thread = NULL;
+			}
+			async_core_delete(shard);
+		}
+		ikmem_free(core->shards);
+		core->shards = NULL;
+		core->nshards = 0;
+	}
 	ASYNC_CORE_CRITICAL_BEGIN(core);
+	while (core->inbox.size >= sizeof(struct CAsyncHandoff)) {
+		struct CAsyncHandoff handoff;
+		ims_read(&core->inbox, &handoff, sizeof(handoff));
+		iclose(handoff.fd);
+	}
+	ims_destroy(&core->inbox);
+	ims_destroy(&core->flush);
 	while (1) {
 		long hid = _async_core_node_head(core);
 		if (hid < 0) break;
 		async_core_node_delete(core, hid);
 	}
-	if (!iqueue_is_empty(&core->head)) {
-		assert(iqueue_is_empty(&core->head));
+	if (core->wheel.count != 0) {
+		assert(core->wheel.count == 0);
 		abort();
 	}
 	if (core->count != 0) {
@@ -1038,20 +1761,22 @@ void async_core_delete(CAsyncCore *core)
 		core->pfd = NULL;
 	}
 	IMUTEX_LOCK(&core->xmsg);
-	ims_destroy(&core->msgs);
+	async_core_msg_destroy(core);
 	IMUTEX_UNLOCK(&core->xmsg);
 	if (core->vector) iv_delete(core->vector);
 	if (core->nodes) imnode_delete(core->nodes);
 	if (core->cache) imnode_delete(core->cache);
+	if (core->hist) ikmem_free(core->hist);
+	core->hist = NULL;
 	core->vector = NULL;
 	core->nodes = NULL;
 	core->cache = NULL;
 	core->data = NULL;
-	iqueue_init(&core->head);
 #ifdef __unix
 	#ifndef __AVM2__
 	if (core->xfd[0] >= 0) close(core->xfd[0]);
-	if (core->xfd[1] >= 0) close(core->xfd[1]);
+	if (core->xfd[1] >= 0 && core->xfd[1] != core->xfd[0]) 
+		close(core->xfd[1]);
 	#endif
 #else
 	if (core->xfd[0] >= 0) iclose(core->xfd[0]);
@@ -1064,6 +1789,7 @@ void async_core_delete(CAsyncCore *core)
 	IMUTEX_DESTROY(&core->xmtx);
 	IMUTEX_DESTROY(&core->lock);
 	IMUTEX_DESTROY(&core->xmsg);
+	IMUTEX_DESTROY(&core->gate);
 	memset(core, 0, sizeof(CAsyncCore));
 	ikmem_free(core);
 }
@@ -1077,16 +1803,19 @@ static long async_core_node_new(CAsyncCore *core)
 	long index, id = -1;
 	CAsyncSock *sock;
 
-	if (core->nodes->node_used >= 0xffff) return -1;
+	if (core->nodes->node_used >= core->imask) return -1;
 	index = (long)imnode_new(core->nodes);
 	if (index < 0) return -2;
 
-	if (index >= 0x10000) {
-		assert(index < 0x10000);
+	if (index > core->imask) {
+		assert(index <= core->imask);
 		abort();
 	}
 
-	id = (index & 0xffff) | (core->index << 16);
+	id = (index & core->imask) | (core->index << 16);
+	if (core->shard >= 0) {
+		id |= ((long)core->shard) << (16 - core->sbits);
+	}
 	core->index++;
 	if (core->index >= 0x7fff) core->index = 1;
 
@@ -1101,11 +1830,14 @@ static long async_core_node_new(CAsyncCore *core)
 	sock->external = core->buffer;
 	sock->buffer = core->buffer;
 	sock->bufsize = core->bufsize;
+	sock->total = &core->stat;
+	core->current = iclock();
 	sock->time = core->current;
+	sock->wtime = core->current;
 	sock->maxsize = core->maxsize;
 	sock->limited = core->limited;
 	sock->flags = 0;
-	iqueue_add_tail(&sock->node, &core->head);
+	async_core_node_timer(core, sock);
 
 	core->count++;
 
@@ -1119,7 +1851,7 @@ static long async_core_node_new(CAsyncCore *core)
 static inline CAsyncSock*
 async_core_node_get(CAsyncCore *core, long hid)
 {
-	long index = hid & 0xffff;
+	long index = hid & core->imask;
 	CAsyncSock *sock;
 	if (index < 0 || index >= (long)core->nodes->node_max)
 		return NULL;
@@ -1136,7 +1868,7 @@ async_core_node_get(CAsyncCore *core, long hid)
 static inline const CAsyncSock*
 async_core_node_get_const(const CAsyncCore *core, long hid)
 {
-	long index = hid & 0xffff;
+	long index = hid & core->imask;
 	const CAsyncSock *sock;
 	if (index < 0 || index >= (long)core->nodes->node_max)
 		return NULL;
@@ -1148,6 +1880,142 @@ async_core_node_get_const(const CAsyncCore *core, long hid)
 }
 
 
+/*-------------------------------------------------------------------*/
+/* cancel node timer                                                 */
+/*-------------------------------------------------------------------*/
+static void async_core_timer_cancel(CAsyncCore *core, CAsyncSock *sock)
+{
+	if (sock->flags & ASYNC_CORE_FLAG_TIMER) {
+		iqueue_del_init(&sock->node);
+		sock->flags &= ~ASYNC_CORE_FLAG_TIMER;
+		core->wheel.count--;
+	}
+}
+
+/*-------------------------------------------------------------------*/
+/* arm node timer, unless an earlier one is pending                  */
+/*-------------------------------------------------------------------*/
+static void async_core_timer_arm(CAsyncCore *core, CAsyncSock *sock,
+	IUINT32 deadline)
+{
+	if (sock->flags & ASYNC_CORE_FLAG_TIMER) {
+		if (itimediff(deadline, sock->expires) >= 0) return;
+		async_core_timer_cancel(core, sock);
+	}
+	sock->expires = deadline;
+	sock->flags |= ASYNC_CORE_FLAG_TIMER;
+	async_core_wheel_link(&core->wheel, sock);
+	core->wheel.count++;
+}
+
+/*-------------------------------------------------------------------*/
+/* earliest deadline of idle, connect and write-stall timeouts,      */
+/* returns zero if none is enabled                                   */
+/*-------------------------------------------------------------------*/
+static int async_core_node_deadline(const CAsyncCore *core, 
+	const CAsyncSock *sock, IUINT32 *deadline, int *code)
+{
+	long idle = (sock->idle < 0)? (long)core->timeout : sock->idle;
+	int found = 0;
+	if (sock->mode == ASYNC_CORE_NODE_LISTEN4 || 
+		sock->mode == ASYNC_CORE_NODE_LISTEN6) 
+		return 0;
+	if (idle > 0) {
+		deadline[0] = sock->time + (IUINT32)idle;
+		code[0] = ASYNC_CORE_CODE_IDLE;
+		found = 1;
+	}
+	if (sock->tmconnect > 0 && sock->state == ASYNC_SOCK_STATE_CONNECTING) {
+		IUINT32 t = sock->time + (IUINT32)sock->tmconnect;
+		if (found == 0 || itimediff(t, deadline[0]) < 0) {
+			deadline[0] = t;
+			code[0] = ASYNC_CORE_CODE_CONNECT;
+			found = 1;
+		}
+	}
+	if (sock->stall > 0 && sock->sendmsg.size > 0) {
+		IUINT32 t = sock->wtime + (IUINT32)sock->stall;
+		if (found == 0 || itimediff(t, deadline[0]) < 0) {
+			deadline[0] = t;
+			code[0] = ASYNC_CORE_CODE_STALL;
+			found = 1;
+		}
+	}
+	return found;
+}
+
+/*-------------------------------------------------------------------*/
+/* make sure the node timer fires no later than its deadline         */
+/*-------------------------------------------------------------------*/
+static void async_core_node_timer(CAsyncCore *core, CAsyncSock *sock)
+{
+	IUINT32 deadline;
+	int code;
+	if (async_core_node_deadline(core, sock, &deadline, &code)) {
+		async_core_timer_arm(core, sock, deadline);
+	}
+}
+
+/*-------------------------------------------------------------------*/
+/* send queue crossed a watermark: tell the producer to throttle     */
+/*-------------------------------------------------------------------*/
+static void async_core_node_water(CAsyncCore *core, CAsyncSock *sock)
+{
+	long size = (long)sock->sendmsg.size;
+	if (sock->hiwater <= 0) return;
+	if ((sock->flags & ASYNC_CORE_FLAG_HIGHWATER) == 0) {
+		if (size >= sock->hiwater) {
+			sock->flags |= ASYNC_CORE_FLAG_HIGHWATER;
+			async_core_msg_push(core, ASYNC_CORE_EVT_HIGHWATER,
+				sock->hid, sock->tag, "", 0);
+		}
+	}
+	else if (size <= sock->lowater) {
+		sock->flags &= ~ASYNC_CORE_FLAG_HIGHWATER;
+		async_core_msg_push(core, ASYNC_CORE_EVT_LOWWATER,
+			sock->hid, sock->tag, "", 0);
+	}
+}
+
+/*-------------------------------------------------------------------*/
+/* send buffered data, restart the write-stall clock on progress     */
+/*-------------------------------------------------------------------*/
+static int async_core_node_send(CAsyncCore *core, CAsyncSock *sock)
+{
+	iulong size = sock->sendmsg.size;
+	int hr = async_sock_update(sock, 2);
+	if (sock->sendmsg.size != size) {
+		sock->wtime = core->current;
+		if (sock->flags & ASYNC_CORE_FLAG_HIGHWATER) {
+			async_core_node_water(core, sock);
+		}
+	}
+	return hr;
+}
+
+
+/*-------------------------------------------------------------------*/
+/* accumulate counters, the peak queue size is a maximum not a sum   */
+/*-------------------------------------------------------------------*/
+static void async_core_stat_add(CAsyncStat *dst, const CAsyncStat *src)
+{
+	dst->rxbytes += src->rxbytes;
+	dst->txbytes += src->txbytes;
+	dst->rxmsgs += src->rxmsgs;
+	dst->txmsgs += src->txmsgs;
+	dst->rxcalls += src->rxcalls;
+	dst->txcalls += src->txcalls;
+	dst->rxagain += src->rxagain;
+	dst->txagain += src->txagain;
+	if (src->sendmax > dst->sendmax) dst->sendmax = src->sendmax;
+	dst->polls += src->polls;
+	dst->wakeups += src->wakeups;
+	dst->events += src->events;
+	dst->spins += src->spins;
+	dst->sleeps += src->sleeps;
+}
+
+
 /*-------------------------------------------------------------------*/
 /* delete node                                                       */
 /*-------------------------------------------------------------------*/
@@ -1155,12 +2023,13 @@ static long async_core_node_delete(CAsyncCore *core, long hid)
 {
 	CAsyncSock *sock = async_core_node_get(core, hid);
 	if (sock == NULL) return -1;
+	async_core_timer_cancel(core, sock);
 	if (!iqueue_is_empty(&sock->node)) {
 		iqueue_del(&sock->node);
 		iqueue_init(&sock->node);
 	}
 	async_sock_destroy(sock);
-	imnode_del(core->nodes, hid & 0xffff);
+	imnode_del(core->nodes, hid & core->imask);
 	core->count--;
 	return 0;
 }
@@ -1173,9 +2042,8 @@ static int async_core_node_active(CAsyncCore *core, long hid)
 {
 	CAsyncSock *sock = async_core_node_get(core, hid);
 	if (sock == NULL) return -1;
+	/* the timer checks this stamp when it fires, no re-arm needed */
 	sock->time = core->current;
-	iqueue_del(&sock->node);
-	iqueue_add_tail(&sock->node, &core->head);
 	return 0;
 }
 
@@ -1197,7 +2065,7 @@ static long _async_core_node_head(const CAsyncCore *core)
 static long _async_core_node_next(const CAsyncCore *core, long hid)
 {
 	const CAsyncSock *sock = async_core_node_get_const(core, hid);
-	long index = hid & 0xffff;
+	long index = hid & core->imask;
 	if (sock == NULL) return -1;
 	index = imnode_next(core->nodes, index);
 	if (index < 0) return -1;
@@ -1215,7 +2083,7 @@ static long _async_core_node_next(const CAsyncCore *core, long hid)
 static long _async_core_node_prev(const CAsyncCore *core, long hid)
 {
 	const CAsyncSock *sock = async_core_node_get_const(core, hid);
-	long index = hid & 0xffff;
+	long index = hid & core->imask;
 	if (sock == NULL) return -1;
 	index = imnode_prev(core->nodes, index);
 	if (index < 0) return -1;
@@ -1228,12 +2096,61 @@ static long _async_core_node_prev(const CAsyncCore *core, long hid)
 }
 
 
+/*-------------------------------------------------------------------*/
+/* last node: walks the whole list                                   */
+/*-------------------------------------------------------------------*/
+static long _async_core_node_tail(const CAsyncCore *core)
+{
+	long hid = _async_core_node_head(core);
+	while (hid >= 0) {
+		long next = _async_core_node_next(core, hid);
+		if (next < 0) break;
+		hid = next;
+	}
+	return hid;
+}
+
+/*-------------------------------------------------------------------*/
+/* sharded mode: first node in shards[start, nshards)                */
+/*-------------------------------------------------------------------*/
+static long async_core_shard_head(const CAsyncCore *core, int start)
+{
+	long hid = -1;
+	int i;
+	for (i = start; i < core->nshards && hid < 0; i++) {
+		const CAsyncCore *shard = core->shards[i];
+		ASYNC_CORE_CRITICAL_BEGIN(shard);
+		hid = _async_core_node_head(shard);
+		ASYNC_CORE_CRITICAL_END(shard);
+	}
+	return hid;
+}
+
+/*-------------------------------------------------------------------*/
+/* sharded mode: last node in shards[0, start]                       */
+/*-------------------------------------------------------------------*/
+static long async_core_shard_tail(const CAsyncCore *core, int start)
+{
+	long hid = -1;
+	int i;
+	for (i = start; i >= 0 && hid < 0; i--) {
+		const CAsyncCore *shard = core->shards[i];
+		ASYNC_CORE_CRITICAL_BEGIN(shard);
+		hid = _async_core_node_tail(shard);
+		ASYNC_CORE_CRITICAL_END(shard);
+	}
+	return hid;
+}
+
 /*-------------------------------------------------------------------*/
 /* thread safe iterator                                              */
 /*-------------------------------------------------------------------*/
 long async_core_node_head(const CAsyncCore *core)
 {
 	long hid;
+	if (core->nshards > 0) {
+		return async_core_shard_head(core, 0);
+	}
 	ASYNC_CORE_CRITICAL_BEGIN(core);
 	hid = _async_core_node_head(core);
 	ASYNC_CORE_CRITICAL_END(core);
@@ -1245,9 +2162,15 @@ long async_core_node_head(const CAsyncCore *core)
 /*-------------------------------------------------------------------*/
 long async_core_node_next(const CAsyncCore *core, long hid)
 {
-	ASYNC_CORE_CRITICAL_BEGIN(core);
-	hid = _async_core_node_next(core, hid);
-	ASYNC_CORE_CRITICAL_END(core);
+	const CAsyncCore *shard = async_core_route(core, hid);
+	int exists;
+	ASYNC_CORE_CRITICAL_BEGIN(shard);
+	exists = (async_core_node_get_const(shard, hid) != NULL);
+	hid = _async_core_node_next(shard, hid);
+	ASYNC_CORE_CRITICAL_END(shard);
+	if (hid < 0 && exists && shard != core) {
+		hid = async_core_shard_head(core, shard->shard + 1);
+	}
 	return hid;
 }
 
@@ -1256,32 +2179,344 @@ long async_core_node_next(const CAsyncCore *core, long hid)
 /*-------------------------------------------------------------------*/
 long async_core_node_prev(const CAsyncCore *core, long hid)
 {
-	ASYNC_CORE_CRITICAL_BEGIN(core);
-	hid = _async_core_node_prev(core, hid);
-	ASYNC_CORE_CRITICAL_END(core);
+	const CAsyncCore *shard = async_core_route(core, hid);
+	int exists;
+	ASYNC_CORE_CRITICAL_BEGIN(shard);
+	exists = (async_core_node_get_const(shard, hid) != NULL);
+	hid = _async_core_node_prev(shard, hid);
+	ASYNC_CORE_CRITICAL_END(shard);
+	if (hid < 0 && exists && shard != core) {
+		hid = async_core_shard_tail(core, shard->shard - 1);
+	}
 	return hid;
 }
 
 /*-------------------------------------------------------------------*/
-/* post message                                                      */
+/* lock-free batch stack: producers push, the reader takes them all  */
+/*-------------------------------------------------------------------*/
+#if defined(__GNUC__) && (!defined(ASYNC_CORE_NO_ATOMIC))
+#define ASYNC_CORE_CAS(ptr, oldval, newval) \
+	__sync_val_compare_and_swap(ptr, oldval, newval)
+#define ASYNC_CORE_CAS_INT(ptr, oldval, newval) \
+	__sync_val_compare_and_swap(ptr, oldval, newval)
+#elif defined(_WIN32) && (!defined(ASYNC_CORE_NO_ATOMIC))
+#define ASYNC_CORE_CAS(ptr, oldval, newval) \
+	InterlockedCompareExchangePointer((PVOID volatile*)(ptr), \
+		(PVOID)(newval), (PVOID)(oldval))
+#define ASYNC_CORE_CAS_INT(ptr, oldval, newval) \
+	((int)InterlockedCompareExchange((LONG volatile*)(ptr), \
+		(LONG)(newval), (LONG)(oldval)))
+#endif
+
+#define ASYNC_CORE_ALIGN(size)	(((size) + 7) & ~((long)7))
+
+#ifndef ASYNC_CORE_BATCH_MIN
+#define ASYNC_CORE_BATCH_MIN	0x4000
+#endif
+
+#ifndef ASYNC_CORE_BATCH_MAX
+#define ASYNC_CORE_BATCH_MAX	0x40000
+#endif
+
+#define ASYNC_CORE_BATCH_DATA(b)	((char*)((struct CAsyncBatch*)(b) + 1))
+
+static void async_core_stack_push(CAsyncCore *master, 
+	struct CAsyncBatch *batch)
+{
+#ifdef ASYNC_CORE_CAS
+	struct CAsyncBatch *head;
+	do {
+		head = master->stack;
+		batch->next = head;
+	}	while ((struct CAsyncBatch*)ASYNC_CORE_CAS(&master->stack, 
+				head, batch) != head);
+#else
+	IMUTEX_LOCK(&master->xmtx);
+	batch->next = master->stack;
+	master->stack = batch;
+	IMUTEX_UNLOCK(&master->xmtx);
+#endif
+}
+
+static struct CAsyncBatch *async_core_stack_take(CAsyncCore *master)
+{
+	struct CAsyncBatch *head;
+#ifdef ASYNC_CORE_CAS
+	do {
+		head = master->stack;
+		if (head == NULL) return NULL;
+	}	while ((struct CAsyncBatch*)ASYNC_CORE_CAS(&master->stack, 
+				head, NULL) != head);
+#else
+	IMUTEX_LOCK(&master->xmtx);
+	head = master->stack;
+	master->stack = NULL;
+	IMUTEX_UNLOCK(&master->xmtx);
+#endif
+	return head;
+}
+
+/*-------------------------------------------------------------------*/
+/* log-linear histogram: exact below 8, then 8 buckets per power of  */
+/* two, so any recorded value is within 12.5% of its bucket          */
+/*-------------------------------------------------------------------*/
+#define ASYNC_HIST_BITS			40
+#define ASYNC_HIST_BUCKETS		((ASYNC_HIST_BITS - 2) * 8)
+#define ASYNC_CORE_HIST_COUNT	3
+
+struct CAsyncHist
+{
+	IINT64 count;
+	IINT64 total;
+	IINT64 max;
+	IUINT32 bucket[ASYNC_HIST_BUCKETS];
+};
+
+static void async_hist_add(struct CAsyncHist *hist, IINT64 value)
+{
+	IUINT64 v = (value < 0)? 0 : (IUINT64)value;
+	int index, msb = 3;
+	if (v >= (((IUINT64)1) << ASYNC_HIST_BITS)) {
+		v = (((IUINT64)1) << ASYNC_HIST_BITS) - 1;
+	}
+	if (v < 8) {
+		index = (int)v;
+	}	else {
+		while ((v >> msb) > 1) msb++;
+		index = (msb - 2) * 8 + (int)((v >> (msb - 3)) & 7);
+	}
+	hist->bucket[index]++;
+	hist->count++;
+	hist->total += (IINT64)v;
+	if ((IINT64)v > hist->max) hist->max = (IINT64)v;
+}
+
+/* highest value which falls into the bucket */
+static IINT64 async_hist_upper(int index)
+{
+	int shift = index / 8 - 1;
+	if (index < 8) return index;
+	return ((((IINT64)(8 + (index & 7))) + 1) << shift) - 1;
+}
+
+static IINT64 async_hist_percentile(const struct CAsyncHist *hist, 
+	int permille)
+{
+	IINT64 need = (hist->count * permille + 999) / 1000, sum = 0;
+	int i;
+	for (i = 0; i < ASYNC_HIST_BUCKETS && hist->count > 0; i++) {
+		sum += hist->bucket[i];
+		if (sum >= need) {
+			IINT64 value = async_hist_upper(i);
+			return (value < hist->max)? value : hist->max;
+		}
+	}
+	return hist->max;
+}
+
+static void async_hist_merge(struct CAsyncHist *dst, 
+	const struct CAsyncHist *src)
+{
+	int i;
+	for (i = 0; i < ASYNC_HIST_BUCKETS; i++) {
+		dst->bucket[i] += src->bucket[i];
+	}
+	dst->count += src->count;
+	dst->total += src->total;
+	if (src->max > dst->max) dst->max = src->max;
+}
+
+/* queue latency of the record being read, reader side only */
+static inline void async_core_msg_sample(CAsyncCore *core, IINT64 *now)
+{
+	IINT64 stamp = core->rhead->stamp;
+	if (stamp == 0 || core->hist == NULL) return;
+	if ((core->flags & ASYNC_CORE_FLAG_HISTOGRAM) == 0) return;
+	if (now[0] == 0) now[0] = iclockrt();
+	async_hist_add(&core->hist[ASYNC_CORE_HIST_QUEUE], now[0] - stamp);
+}
+
+
+/*-------------------------------------------------------------------*/
+/* publish events encoded by this core to the reader                 */
+/*-------------------------------------------------------------------*/
+static void async_core_msg_publish(CAsyncCore *core)
+{
+	struct CAsyncBatch *batch = core->batch;
+	if (batch == NULL) return;
+	core->batch = NULL;
+	if (batch->size == 0) {
+		ikmem_free(batch);
+		return;
+	}
+	if (batch->size < (batch->capacity >> 2)) {
+		/* a few records from a locked call: don't pin the whole block
+		   until the reader gets there, mostly one per new connection */
+		long size = (long)sizeof(struct CAsyncBatch) + batch->size;
+		struct CAsyncBatch *small = (struct CAsyncBatch*)ikmem_malloc(size);
+		if (small != NULL) {
+			memcpy(small, batch, size);
+			small->capacity = batch->size;
+			ikmem_free(batch);
+			batch = small;
+		}
+	}
+	async_core_stack_push(core->master, batch);
+	if (core->master != core) core->xdirty = 1;
+}
+
+/*-------------------------------------------------------------------*/
+/* allocate a record in the producer batch, returns payload pointer  */
+/*-------------------------------------------------------------------*/
+static char *async_core_msg_alloc(CAsyncCore *core, int event, 
+	long wparam, long lparam, long size)
+{
+	struct CAsyncBatch *batch = core->batch;
+	struct CAsyncRecord *record;
+	long need = (long)sizeof(struct CAsyncRecord) + ASYNC_CORE_ALIGN(size);
+	if (batch != NULL && batch->size + need > batch->capacity) {
+		if (batch->size >= ASYNC_CORE_BATCH_MAX) {
+			async_core_msg_publish(core);
+			batch = NULL;
+		}	else {
+			long capacity = batch->capacity * 2;
+			if (capacity < batch->size + need) capacity = batch->size + need;
+			batch = (struct CAsyncBatch*)ikmem_realloc(batch, 
+				sizeof(struct CAsyncBatch) + capacity);
+			if (batch == NULL) return NULL;
+			batch->capacity = capacity;
+			core->batch = batch;
+		}
+	}
+	if (batch == NULL) {
+		long capacity = (need < ASYNC_CORE_BATCH_MIN)? 
+			ASYNC_CORE_BATCH_MIN : need;
+		batch = (struct CAsyncBatch*)ikmem_malloc(
+			sizeof(struct CAsyncBatch) + capacity);
+		if (batch == NULL) return NULL;
+		batch->next = NULL;
+		batch->size = 0;
+		batch->capacity = capacity;
+		batch->stamp = 0;
+		if (core->flags & ASYNC_CORE_FLAG_HISTOGRAM) {
+			batch->stamp = iclockrt();
+		}
+		core->batch = batch;
+	}
+	record = (struct CAsyncRecord*)(ASYNC_CORE_BATCH_DATA(batch) + 
+		batch->size);
+	record->length = size;
+	record->event = event;
+	record->wparam = wparam;
+	record->lparam = lparam;
+	batch->size += need;
+	core->msgcnt++;
+	return (char*)(record + 1);
+}
+
+/*-------------------------------------------------------------------*/
+/* post message, called with the core locked                         */
 /*-------------------------------------------------------------------*/
 static int async_core_msg_push(CAsyncCore *core, int event, long wparam, 
 	long lparam, const void *data, long size)
 {
-	char head[14];
+	char *ptr;
 	size = size < 0 ? 0 : size;
-	iencode32u_lsb(head, (long)(size + 14));
-	iencode16u_lsb(head + 4, (unsigned short)event);
-	iencode32i_lsb(head + 6, wparam);
-	iencode32i_lsb(head + 10, lparam);
-	if (core->nolock == 0) IMUTEX_LOCK(&core->xmsg);
-	ims_write(&core->msgs, head, 14);
-	ims_write(&core->msgs, data, size);
-	core->msgcnt++;
-	if (core->nolock == 0) IMUTEX_UNLOCK(&core->xmsg);
+	ptr = async_core_msg_alloc(core, event, wparam, lparam, size);
+	if (ptr == NULL) return -1;
+	if (size > 0) memcpy(ptr, data, size);
 	return 0;
 }
 
+/*-------------------------------------------------------------------*/
+/* post message, payload moved page by page from a stream            */
+/*-------------------------------------------------------------------*/
+static int async_core_msg_push_stream(CAsyncCore *core, int event, 
+	long wparam, long lparam, struct IMSTREAM *src, long size)
+{
+	char *ptr;
+	size = size < 0 ? 0 : size;
+	ptr = async_core_msg_alloc(core, event, wparam, lparam, size);
+	if (ptr == NULL) return -1;
+	while (size > 0) {
+		void *pos;
+		long csize = (long)ims_flat(src, &pos);
+		if (csize <= 0) break;
+		if (csize > size) csize = size;
+		memcpy(ptr, pos, csize);
+		ims_drop(src, csize);
+		ptr += csize;
+		size -= csize;
+	}
+	return 0;
+}
+
+/*-------------------------------------------------------------------*/
+/* first unread record, refilled from the stack, reader side only    */
+/*-------------------------------------------------------------------*/
+static struct CAsyncRecord *async_core_msg_front(CAsyncCore *core)
+{
+	while (1) {
+		struct CAsyncBatch *batch = core->rhead;
+		if (batch != NULL) {
+			if (core->rpos < batch->size) {
+				return (struct CAsyncRecord*)
+					(ASYNC_CORE_BATCH_DATA(batch) + core->rpos);
+			}
+			/* keep it until the next read, read_batch points into it */
+			core->rhead = batch->next;
+			if (core->rhead == NULL) core->rtail = NULL;
+			core->rpos = 0;
+			batch->next = core->rdone;
+			core->rdone = batch;
+			continue;
+		}
+		batch = async_core_stack_take(core);
+		if (batch == NULL) return NULL;
+		/* the stack is newest first: reverse it into reading order */
+		core->rtail = batch;
+		while (batch) {
+			struct CAsyncBatch *next = batch->next;
+			batch->next = core->rhead;
+			core->rhead = batch;
+			batch = next;
+		}
+	}
+}
+
+/*-------------------------------------------------------------------*/
+/* free batches consumed by the previous read                        */
+/*-------------------------------------------------------------------*/
+static void async_core_msg_retire(CAsyncCore *core)
+{
+	while (core->rdone) {
+		struct CAsyncBatch *batch = core->rdone;
+		core->rdone = batch->next;
+		ikmem_free(batch);
+	}
+}
+
+/*-------------------------------------------------------------------*/
+/* free all pending batches                                          */
+/*-------------------------------------------------------------------*/
+static void async_core_msg_destroy(CAsyncCore *core)
+{
+	struct CAsyncBatch *batch, *next;
+	async_core_msg_retire(core);
+	if (core->batch) ikmem_free(core->batch);
+	core->batch = NULL;
+	for (batch = async_core_stack_take(core); batch; batch = next) {
+		next = batch->next;
+		ikmem_free(batch);
+	}
+	for (batch = core->rhead; batch; batch = next) {
+		next = batch->next;
+		ikmem_free(batch);
+	}
+	core->rhead = NULL;
+	core->rtail = NULL;
+	core->rpos = 0;
+}
 
 /*-------------------------------------------------------------------*/
 /* get message                                                       */
@@ -1289,53 +2524,76 @@ static int async_core_msg_push(CAsyncCore *core, int event, long wparam,
 static long async_core_msg_read(CAsyncCore *core, int *event, long *wparam,
 	long *lparam, void *data, long size)
 {
-	char head[14];
-	IUINT32 length;
-	IINT32 x;
-	IUINT16 y;
-	int EVENT;
-	long WPARAM;
-	long LPARAM;
+	struct CAsyncRecord *record;
+	IINT64 now = 0;
+	long length;
+	/* xmsg only serializes readers, producers never take it */
 	if (core->nolock == 0) {
 		IMUTEX_LOCK(&core->xmsg);
 	}
-	if (ims_peek(&core->msgs, head, 4) < 4) {
+	async_core_msg_retire(core);
+	record = async_core_msg_front(core);
+	if (record == NULL) {
 		if (core->nolock == 0) {
 			IMUTEX_UNLOCK(&core->xmsg);
 		}
 		return -1;
 	}
-	idecode32u_lsb(head, &length);
-	length -= 14;
+	length = record->length;
 	if (data == NULL) {
 		if (core->nolock == 0) {
 			IMUTEX_UNLOCK(&core->xmsg);
 		}
 		return length;
 	}
-	if (size < (long)length) {
+	if (size < length) {
 		if (core->nolock == 0) {
 			IMUTEX_UNLOCK(&core->xmsg);
 		}
 		return -2;
 	}
-	ims_read(&core->msgs, head, 14);
-	idecode16u_lsb(head + 4, &y);
-	EVENT = y;
-	idecode32i_lsb(head + 6, &x);
-	WPARAM = x;
-	idecode32i_lsb(head + 10, &x);
-	LPARAM = x;
-	ims_read(&core->msgs, data, length);
+	if (event) event[0] = (int)record->event;
+	if (wparam) wparam[0] = record->wparam;
+	if (lparam) lparam[0] = record->lparam;
+	if (length > 0) memcpy(data, record + 1, length);
+	async_core_msg_sample(core, &now);
+	core->rpos += (long)sizeof(struct CAsyncRecord) + ASYNC_CORE_ALIGN(length);
 	if (core->nolock == 0) {
 		IMUTEX_UNLOCK(&core->xmsg);
 	}
-	if (event) event[0] = EVENT;
-	if (wparam) wparam[0] = WPARAM;
-	if (lparam) lparam[0] = LPARAM;
 	return length;
 }
 
+/*-------------------------------------------------------------------*/
+/* get messages: fill descriptors pointing into batches              */
+/*-------------------------------------------------------------------*/
+static int async_core_msg_read_batch(CAsyncCore *core, 
+	CAsyncEvent *events, int count)
+{
+	IINT64 now = 0;
+	int n = 0;
+	if (core->nolock == 0) {
+		IMUTEX_LOCK(&core->xmsg);
+	}
+	async_core_msg_retire(core);
+	for (n = 0; n < count; n++) {
+		struct CAsyncRecord *record = async_core_msg_front(core);
+		if (record == NULL) break;
+		events[n].event = (int)record->event;
+		events[n].wparam = record->wparam;
+		events[n].lparam = record->lparam;
+		events[n].ptr = (const char*)(record + 1);
+		events[n].len = record->length;
+		async_core_msg_sample(core, &now);
+		core->rpos += (long)sizeof(struct CAsyncRecord) + 
+			ASYNC_CORE_ALIGN(record->length);
+	}
+	if (core->nolock == 0) {
+		IMUTEX_UNLOCK(&core->xmsg);
+	}
+	return n;
+}
+
 
 /*-------------------------------------------------------------------*/
 /* resize buffer                                                     */
@@ -1364,43 +2622,160 @@ static int async_core_buffer_resize(CAsyncCore *core, long newsize)
 		sock->bufsize = core->bufsize;
 		hid = _async_core_node_next(core, hid);
 	}
-
-	return 0;
+
+	return 0;
+}
+
+/*-------------------------------------------------------------------*/
+/* change event mask                                                 */
+/*-------------------------------------------------------------------*/
+static int async_core_node_mask(CAsyncCore *core, CAsyncSock *sock, 
+	int enable, int disable)
+{
+	int mask;
+	if (core == NULL || sock == NULL) return -1;
+	mask = sock->mask;
+	if (disable & IPOLL_IN) sock->mask &= ~(IPOLL_IN);
+	if (disable & IPOLL_OUT) sock->mask &= ~(IPOLL_OUT);
+	if (disable & IPOLL_ERR) sock->mask &= ~(IPOLL_ERR);
+	if (enable & IPOLL_IN) sock->mask |= IPOLL_IN;
+	if (enable & IPOLL_OUT) sock->mask |= IPOLL_OUT;
+	if (enable & IPOLL_ERR) sock->mask |= IPOLL_ERR;
+	if (core->edge) {
+		/* edge-triggered: IPOLL_OUT stays armed in the kernel, only
+		 * sock->mask tracks whether we are waiting for it */
+		if (((mask ^ sock->mask) & ~IPOLL_OUT) == 0 && mask != 0) 
+			return 0;
+		return ipoll_set(core->pfd, sock->fd, sock->mask | IPOLL_OUT);
+	}
+	return ipoll_set(core->pfd, sock->fd, sock->mask);
+}
+
+/*-------------------------------------------------------------------*/
+/* spin mode: let the kernel busy poll the device queue on reads     */
+/*-------------------------------------------------------------------*/
+static void async_core_node_busy(CAsyncCore *core, int fd)
+{
+#ifdef SO_BUSY_POLL
+	if (core->busypoll > 0 && fd >= 0) {
+		int value = (int)core->busypoll;
+		isetsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, (const char*)&value,
+			sizeof(value));
+	}
+#endif
+}
+
+/*-------------------------------------------------------------------*/
+/* setup node for an accepted socket                                 */
+/*-------------------------------------------------------------------*/
+static long async_core_accept_new(CAsyncCore *core, int fd, long listen_hid,
+	int head, long limited, long maxsize, const struct sockaddr *remote,
+	int addrlen)
+{
+	CAsyncSock *sock;
+	long hid;
+	int hr;
+
+	hid = async_core_node_new(core);
+
+	if (hid < 0) {
+		iclose(fd);
+		return -6;
+	}
+
+	sock = async_core_node_get(core, hid);
+
+	if (sock == NULL) {
+		assert(sock);
+		abort();
+	}
+
+	sock->mode = ASYNC_CORE_NODE_IN;
+	sock->ipv6 = (addrlen == sizeof(struct sockaddr_in))? 0 : 1;
+	sock->link = listen_hid;
+
+	async_sock_assign(sock, fd, head);
+
+	ienable(fd, ISOCK_CLOEXEC);
+	async_core_node_busy(core, fd);
+
+	sock->limited = limited;
+	sock->maxsize = maxsize;
+	
+	hr = ipoll_add(core->pfd, fd, IPOLL_IN | IPOLL_ERR, sock);
+	if (hr != 0) {
+		async_core_node_delete(core, hid);
+		return -7;
+	}
+
+	async_core_node_mask(core, sock, IPOLL_IN | IPOLL_ERR, 0);
+
+	async_core_msg_push(core, ASYNC_CORE_EVT_NEW, hid, 
+		listen_hid, remote, addrlen);
+
+	return hid;
+}
+
+
+/*-------------------------------------------------------------------*/
+/* sharded mode: adopt sockets accepted by other shards              */
+/*-------------------------------------------------------------------*/
+static void async_core_adopt(CAsyncCore *core)
+{
+	struct CAsyncHandoff handoff;
+	while (1) {
+		int hr = 0;
+		IMUTEX_LOCK(&core->xmtx);
+		if (core->inbox.size >= sizeof(handoff)) {
+			ims_read(&core->inbox, &handoff, sizeof(handoff));
+			hr = 1;
+		}
+		IMUTEX_UNLOCK(&core->xmtx);
+		if (hr == 0) break;
+		if (core->count >= core->imask) {
+			iclose(handoff.fd);
+			continue;
+		}
+		async_core_accept_new(core, handoff.fd, handoff.listen_hid,
+			handoff.header, handoff.limited, handoff.maxsize,
+			(const struct sockaddr*)handoff.remote, handoff.addrlen);
+	}
 }
 
+
 /*-------------------------------------------------------------------*/
-/* change event mask                                                 */
+/* update listener accept rate, counted in one second windows        */
 /*-------------------------------------------------------------------*/
-static int async_core_node_mask(CAsyncCore *core, CAsyncSock *sock, 
-	int enable, int disable)
+static void async_core_accept_tick(CAsyncCore *core, CAsyncSock *sock,
+	long count)
 {
-	if (core == NULL || sock == NULL) return -1;
-	if (disable & IPOLL_IN) sock->mask &= ~(IPOLL_IN);
-	if (disable & IPOLL_OUT) sock->mask &= ~(IPOLL_OUT);
-	if (disable & IPOLL_ERR) sock->mask &= ~(IPOLL_ERR);
-	if (enable & IPOLL_IN) sock->mask |= IPOLL_IN;
-	if (enable & IPOLL_OUT) sock->mask |= IPOLL_OUT;
-	if (enable & IPOLL_ERR) sock->mask |= IPOLL_ERR;
-	return ipoll_set(core->pfd, sock->fd, sock->mask);
+	IINT32 diff = itimediff(core->current, sock->astamp);
+	if (diff >= 1000 || diff < 0) {
+		sock->arate = (diff > 0)? (long)(sock->acount * 1000.0 / diff) : 0;
+		sock->acount = 0;
+		sock->astamp = core->current;
+	}
+	sock->acount += count;
+	sock->accepted += count;
 }
 
 /*-------------------------------------------------------------------*/
 /* new accept                                                        */
 /*-------------------------------------------------------------------*/
-static long async_core_accept(CAsyncCore *core, long listen_hid)
+static long async_core_accept(CAsyncCore *core, long hid)
 {
-	CAsyncSock *sock = async_core_node_get(core, listen_hid);
+	CAsyncSock *sock = async_core_node_get(core, hid);
+	long listen_hid;
 	struct sockaddr_in remote4;
 	struct sockaddr_in6 remote6;
 	struct sockaddr *remote;
-	long hid, limited, maxsize;
 	int fd = -1;
 	int addrlen = 0;
-	int head = 0;
-	int hr;
 
 	if (sock == NULL) return -1;
-	if (core->count >= 0xffff) return -2;
+	if (core->count >= core->imask) return -2;
+
+	listen_hid = sock->link;
 
 	if (sock->mode == ASYNC_CORE_NODE_LISTEN4) {
 		addrlen = sizeof(remote4);
@@ -1422,52 +2797,39 @@ static long async_core_accept(CAsyncCore *core, long listen_hid)
 
 	if (core->validator) {
 		void *user = core->user;
-		if (core->validator(remote, addrlen, core, listen_hid, user) == 0) {
+		CAsyncCore *master = core->master;
+		if (core->validator(remote, addrlen, master, listen_hid, user) == 0) {
 			iclose(fd);
 			return -5;
 		}
 	}
 
-	hid = async_core_node_new(core);
-
-	if (hid < 0) {
-		iclose(fd);
-		return -6;
-	}
-
-	head = sock->header;
-	limited = sock->limited;
-	maxsize = sock->maxsize;
-
-	sock = async_core_node_get(core, hid);
-
-	if (sock == NULL) {
-		assert(sock);
-		abort();
-	}
-
-	sock->mode = ASYNC_CORE_NODE_IN;
-	sock->ipv6 = (addrlen == sizeof(remote4))? 0 : 1;
-
-	async_sock_assign(sock, fd, head);
-
-	ienable(fd, ISOCK_CLOEXEC);
-
-	sock->limited = limited;
-	sock->maxsize = maxsize;
-	
-	hr = ipoll_add(core->pfd, fd, IPOLL_IN | IPOLL_ERR, sock);
-	if (hr != 0) {
-		async_core_node_delete(core, hid);
-		return -7;
+	async_core_accept_tick(core, sock, 1);
+
+	/* fan-out listeners are balanced by the kernel, keep it local */
+	if (core->shard >= 0 && (sock->flags & ASYNC_CORE_FLAG_FANOUT) == 0) {
+		CAsyncCore *master = core->master;
+		CAsyncCore *target = master->shards[core->rotate];
+		core->rotate = (core->rotate + 1) % master->nshards;
+		if (target != core) {
+			struct CAsyncHandoff handoff;
+			handoff.fd = fd;
+			handoff.header = sock->header;
+			handoff.addrlen = addrlen;
+			handoff.listen_hid = listen_hid;
+			handoff.limited = sock->limited;
+			handoff.maxsize = sock->maxsize;
+			memcpy(handoff.remote, remote, addrlen);
+			IMUTEX_LOCK(&target->xmtx);
+			ims_write(&target->inbox, &handoff, sizeof(handoff));
+			IMUTEX_UNLOCK(&target->xmtx);
+			async_core_notify(target);
+			return 0;
+		}
 	}
 
-	async_core_node_mask(core, sock, IPOLL_IN | IPOLL_ERR, 0);
-
-	async_core_msg_push(core, ASYNC_CORE_EVT_NEW, hid, 
-		listen_hid, remote, addrlen);
-
-	return hid;
+	return async_core_accept_new(core, fd, listen_hid, sock->header,
+		sock->limited, sock->maxsize, remote, addrlen);
 }
 
 
@@ -1497,6 +2859,8 @@ static long _async_core_new_connect(CAsyncCore *core,
 		return -2;
 	}
 
+	async_core_node_busy(core, sock->fd);
+
 	hr = ipoll_add(core->pfd, sock->fd, IPOLL_OUT | IPOLL_ERR, sock);
 	if (hr != 0) {
 		async_core_node_delete(core, hid);
@@ -1570,6 +2934,8 @@ static long _async_core_new_assign(CAsyncCore *core, int fd,
 	async_sock_assign(sock, fd, header);
 	sock->ipv6 = ipv6;
 
+	async_core_node_busy(core, sock->fd);
+
 	hr = ipoll_add(core->pfd, sock->fd, IPOLL_OUT | IPOLL_ERR, sock);
 	if (hr != 0) {
 		async_core_node_delete(core, hid);
@@ -1594,11 +2960,11 @@ static long _async_core_new_assign(CAsyncCore *core, int fd,
 /* new listener, returns hid                                         */
 /*-------------------------------------------------------------------*/
 static long _async_core_new_listen(CAsyncCore *core, 
-	const struct sockaddr *addr, int addrlen, int header)
+	const struct sockaddr *addr, int addrlen, int header, long link)
 {
 	CAsyncSock *sock;
 	int fd, ipv6 = 0;
-	int hr, flag = 0;
+	int hr, flag = 0, fanout = 0;
 	long hid;
 
 	if (addrlen >= (int)sizeof(struct sockaddr_in6)) {
@@ -1639,6 +3005,16 @@ static long _async_core_new_listen(CAsyncCore *core,
 		ienable(fd, ISOCK_UNIXREUSE);
 	}
 
+	if (header & ASYNC_CORE_LISTEN_FANOUT) {
+		if (ienable(fd, ISOCK_REUSEPORT) == 0) {
+			fanout = 1;
+		}	
+		else if (link >= 0) {
+			iclose(fd);
+			return -6;
+		}
+	}
+
 	ienable(fd, ISOCK_CLOEXEC);
 
 	if (ibind(fd, addr, addrlen) != 0) {
@@ -1676,12 +3052,24 @@ static long _async_core_new_listen(CAsyncCore *core,
 	async_core_node_mask(core, sock, IPOLL_IN | IPOLL_ERR, 0);
 	sock->mode = ipv6? ASYNC_CORE_NODE_LISTEN6 : ASYNC_CORE_NODE_LISTEN4;
 
-	if (!iqueue_is_empty(&sock->node)) {
-		iqueue_del(&sock->node);
-		iqueue_init(&sock->node);
-	}
+	/* listeners never time out, keep them in their own list */
+	async_core_timer_cancel(core, sock);
+	iqueue_add_tail(&sock->node, &core->listens);
 
 	sock->header = header & 0xff;
+	sock->astamp = core->current;
+
+	if (fanout) {
+		sock->flags |= ASYNC_CORE_FLAG_FANOUT;
+	}
+
+	if (link >= 0) {
+		/* fan-out sibling: events are reported with the primary hid */
+		sock->link = link;
+		return hid;
+	}
+
+	sock->link = hid;
 
 	async_core_msg_push(core, ASYNC_CORE_EVT_NEW, hid, 
 		-1, addr, addrlen);
@@ -1689,6 +3077,30 @@ static long _async_core_new_listen(CAsyncCore *core,
 	return hid;
 }
 
+/*-------------------------------------------------------------------*/
+/* sharded mode: close fan-out siblings of the given listener        */
+/*-------------------------------------------------------------------*/
+static void async_core_close_siblings(CAsyncCore *core, long hid)
+{
+	int i;
+	for (i = 0; i < core->nshards; i++) {
+		CAsyncCore *shard = core->shards[i];
+		struct IQUEUEHEAD *it, *next;
+		ASYNC_CORE_CRITICAL_BEGIN(shard);
+		for (it = shard->listens.next; it != &shard->listens; it = next) {
+			CAsyncSock *sock = iqueue_entry(it, CAsyncSock, node);
+			next = it->next;
+			if (sock->link == hid && sock->hid != hid) {
+				if (sock->fd >= 0) {
+					ipoll_del(shard->pfd, sock->fd);
+				}
+				async_core_node_delete(shard, sock->hid);
+			}
+		}
+		ASYNC_CORE_CRITICAL_END(shard);
+	}
+}
+
 /*-------------------------------------------------------------------*/
 /* thread safe                                                       */
 /*-------------------------------------------------------------------*/
@@ -1696,6 +3108,7 @@ long async_core_new_connect(CAsyncCore *core,
 	const struct sockaddr *addr, int addrlen, int header)
 {
 	long hr;
+	core = async_core_pick(core);
 	ASYNC_CORE_CRITICAL_BEGIN(core);
 	hr = _async_core_new_connect(core, addr, addrlen, header);
 	ASYNC_CORE_CRITICAL_END(core);
@@ -1708,10 +3121,47 @@ long async_core_new_connect(CAsyncCore *core,
 long async_core_new_listen(CAsyncCore *core, 
 	const struct sockaddr *addr, int addrlen, int header)
 {
+	struct sockaddr_in6 bound;
+	CAsyncCore *master = core;
+	int size = sizeof(bound);
 	long hr;
+	int i;
+	core = async_core_pick(master);
 	ASYNC_CORE_CRITICAL_BEGIN(core);
-	hr = _async_core_new_listen(core, addr, addrlen, header);
+	hr = _async_core_new_listen(core, addr, addrlen, header, -1);
+	if (hr >= 0 && master->nshards > 0 && 
+		(header & ASYNC_CORE_LISTEN_FANOUT)) {
+		CAsyncSock *sock = async_core_node_get(core, hr);
+		if ((sock->flags & ASYNC_CORE_FLAG_FANOUT) == 0 || 
+			isockname(sock->fd, (struct sockaddr*)&bound, &size) != 0) {
+			size = 0;
+		}
+	}	else {
+		size = 0;
+	}
 	ASYNC_CORE_CRITICAL_END(core);
+	/* siblings bind the resolved address, in case of port zero */
+	for (i = 0; size > 0 && i < master->nshards; i++) {
+		CAsyncCore *shard = master->shards[i];
+		long sibling;
+		if (shard == core) continue;
+		ASYNC_CORE_CRITICAL_BEGIN(shard);
+		sibling = _async_core_new_listen(shard, (struct sockaddr*)&bound, 
+			size, header, hr);
+		ASYNC_CORE_CRITICAL_END(shard);
+		if (sibling < 0) {
+			/* no silent partial fan-out: undo the whole listener */
+			CAsyncSock *sock;
+			async_core_close_siblings(master, hr);
+			ASYNC_CORE_CRITICAL_BEGIN(core);
+			sock = async_core_node_get(core, hr);
+			if (sock != NULL) {
+				async_core_event_close(core, sock, 0);
+			}
+			ASYNC_CORE_CRITICAL_END(core);
+			return sibling;
+		}
+	}
 	return hr;
 }
 
@@ -1722,6 +3172,7 @@ long async_core_new_assign(CAsyncCore *core, int fd,
 	int header, int estab)
 {
 	long hr;
+	core = async_core_pick(core);
 	ASYNC_CORE_CRITICAL_BEGIN(core);
 	hr = _async_core_new_assign(core, fd, header, estab);
 	ASYNC_CORE_CRITICAL_END(core);
@@ -1746,43 +3197,266 @@ static void async_core_event_close(CAsyncCore *core,
 	async_core_node_delete(core, sock->hid);
 }
 
+/*-------------------------------------------------------------------*/
+/* push the complete messages in recvmsg, returns close code or 0    */
+/*-------------------------------------------------------------------*/
+static int async_core_node_pump(CAsyncCore *core, CAsyncSock *sock)
+{
+	int code = 0;
+	while (1) {
+		long size = async_sock_recv(sock, NULL, 0);
+		if (size < 0) {	/* not enough data or size error */
+			if (size == -3 || size == -4) {	/* size error */
+				code = (size == -3)? 2001 : 2002;
+			}
+			break;
+		}
+		else if (sock->header == ITMH_RAWDATA) {
+			/* raw data: no header, skip core->buffer */
+			async_core_msg_push_stream(core, ASYNC_CORE_EVT_DATA,
+				sock->hid, sock->tag, &sock->recvmsg, size);
+			ASYNC_SOCK_STAT_ADD(sock, rxmsgs, 1);
+			continue;
+		}
+		else if (size > core->bufsize) {	/* buffer resize */
+			if (async_core_buffer_resize(core, size) != 0) {
+				code = 2003;
+				break;
+			}
+		}
+		size = async_sock_recv(sock, core->buffer, core->bufsize);
+		async_core_msg_push(core, ASYNC_CORE_EVT_DATA,
+			sock->hid, sock->tag, core->buffer, size);
+	}
+	if (sock->recvmsg.size == 0) {
+		ims_trim(&sock->recvmsg);
+	}
+	return code;
+}
+
+/*-------------------------------------------------------------------*/
+/* edge-triggered: the read stopped before EAGAIN, no new edge will  */
+/* come, so read it again from the flush list before the next poll   */
+/*-------------------------------------------------------------------*/
+static void async_core_node_rxmore(CAsyncCore *core, CAsyncSock *sock)
+{
+	if ((sock->flags & ASYNC_CORE_FLAG_RXMORE) == 0) {
+		sock->flags |= ASYNC_CORE_FLAG_RXMORE;
+		ims_write(&core->flush, &sock->hid, sizeof(sock->hid));
+	}
+}
+
+/*-------------------------------------------------------------------*/
+/* edge-triggered: send data queued since the last poll, and go on   */
+/* reading sockets which yielded before EAGAIN                       */
+/*-------------------------------------------------------------------*/
+static void async_core_flush(CAsyncCore *core)
+{
+	long hid, count = (long)(core->flush.size / sizeof(hid));
+	for (; count > 0; count--) {
+		CAsyncSock *sock;
+		if (ims_read(&core->flush, &hid, sizeof(hid)) != sizeof(hid)) break;
+		sock = async_core_node_get(core, hid);
+		if (sock == NULL || sock->fd < 0) continue;
+		if (sock->state != ASYNC_SOCK_STATE_ESTAB) continue;
+		if (sock->flags & ASYNC_CORE_FLAG_RXMORE) {
+			int hr;
+			sock->flags &= ~ASYNC_CORE_FLAG_RXMORE;
+			hr = async_sock_update(sock, 9);
+			if (hr < 0) {
+				async_core_event_close(core, sock, 0);
+				continue;
+			}
+			if (hr > 0) {
+				async_core_node_rxmore(core, sock);
+			}
+			async_core_node_active(core, sock->hid);
+			hr = async_core_node_pump(core, sock);
+			if (hr != 0) {
+				async_core_event_close(core, sock, hr);
+				continue;
+			}
+		}
+		if (sock->sendmsg.size == 0) continue;
+		if (async_core_node_send(core, sock) != 0) {
+			async_core_event_close(core, sock, 2005);
+			continue;
+		}
+		if (sock->sendmsg.size == 0 && (sock->mask & IPOLL_OUT)) {
+			async_core_node_mask(core, sock, 0, IPOLL_OUT);
+			if (sock->flags & ASYNC_CORE_FLAG_PROGRESS) {
+				async_core_msg_push(core, ASYNC_CORE_EVT_PROGRESS,
+					sock->hid, sock->tag, core->buffer, 0);
+			}
+		}
+	}
+}
+
+/*-------------------------------------------------------------------*/
+/* close nodes whose timeouts expired, re-arm the others             */
+/*-------------------------------------------------------------------*/
+static void async_core_timer_run(CAsyncCore *core)
+{
+	struct IQUEUEHEAD expired;
+	if (core->wheel.count == 0) {
+		core->wheel.jiffies = core->current;
+		return;
+	}
+	iqueue_init(&expired);
+	async_core_wheel_run(&core->wheel, core->current, &expired);
+	while (!iqueue_is_empty(&expired)) {
+		CAsyncSock *sock = iqueue_entry(expired.next, CAsyncSock, node);
+		IUINT32 deadline;
+		int code;
+		async_core_timer_cancel(core, sock);
+		if (async_core_node_deadline(core, sock, &deadline, &code) == 0) {
+			continue;
+		}
+		if (itimediff(core->current, deadline) >= 0) {
+			async_core_event_close(core, sock, code);
+		}	else {
+			async_core_timer_arm(core, sock, deadline);
+		}
+	}
+}
+
+/*-------------------------------------------------------------------*/
+/* poll, in spin mode without blocking until the budget is used up   */
+/*-------------------------------------------------------------------*/
+static int async_core_poll(CAsyncCore *core, IUINT32 millisec)
+{
+	IINT64 current, deadline, limit;
+	int count;
+	if (core->spin > 0 && millisec > 0) {
+		current = iclockrt();
+		limit = current + ((IINT64)millisec) * 1000;
+		deadline = current + core->spin;
+		if (deadline > limit) deadline = limit;
+		while (1) {
+			count = ipoll_wait(core->pfd, 0);
+			core->stat.spins++;
+			if (count != 0) return count;
+			current = iclockrt();
+			if (current >= deadline) break;
+		}
+		if (current >= limit) return 0;
+		millisec = (IUINT32)((limit - current + 999) / 1000);
+	}
+	if (millisec > 0) {
+		core->stat.sleeps++;
+	}
+	return ipoll_wait(core->pfd, millisec);
+}
+
+/*-------------------------------------------------------------------*/
+/* write one wakeup token: 8 bytes for eventfd, 1 byte for a pipe    */
+/*-------------------------------------------------------------------*/
+static int async_core_signal(CAsyncCore *core)
+{
+	int fd = core->xfd[ASYNC_CORE_PIPE_WRITE];
+	int hr = -1;
+	if (fd < 0) return -1;
+#ifdef __unix
+	#ifndef __AVM2__
+	if (fd == core->xfd[ASYNC_CORE_PIPE_READ]) {
+		IUINT64 one = 1;
+		hr = (write(fd, &one, 8) == 8)? 0 : -1;
+	}	else {
+		char dummy = 1;
+		hr = (write(fd, &dummy, 1) == 1)? 0 : -1;
+	}
+	#endif
+#else
+	{
+		char dummy = 1;
+		hr = (send(fd, &dummy, 1, 0) == 1)? 0 : -1;
+	}
+#endif
+	return hr;
+}
+
+/*-------------------------------------------------------------------*/
+/* consume the wakeup token, then allow the next notify to signal    */
+/*-------------------------------------------------------------------*/
+static void async_core_drain(CAsyncCore *core)
+{
+	int fd = core->xfd[ASYNC_CORE_PIPE_READ];
+	char dummy[10];
+#ifndef ASYNC_CORE_CAS_INT
+	IMUTEX_LOCK(&core->xmtx);
+#endif
+#ifdef __unix
+	#ifndef __AVM2__
+	read(fd, dummy, 8);
+	#endif
+#else
+	irecv(fd, dummy, 8, 0);
+#endif
+#ifdef ASYNC_CORE_CAS_INT
+	ASYNC_CORE_CAS_INT(&core->xfd[ASYNC_CORE_PIPE_FLAG], 1, 0);
+#else
+	core->xfd[ASYNC_CORE_PIPE_FLAG] = 0;
+	IMUTEX_UNLOCK(&core->xmtx);
+#endif
+}
+
 /*-------------------------------------------------------------------*/
 /* wait for events for millisec ms. and process events,              */
 /* if millisec equals zero, no wait.                                 */
 /*-------------------------------------------------------------------*/
 static void async_core_process_events(CAsyncCore *core, IUINT32 millisec)
 {
+	struct ipoll_result results[ASYNC_CORE_EVENTS];
 	int fd, event, x, count, xf, code = 2010;
+	int index = 0, fetched = 0;
+	IINT64 start = 0;
 	void *udata;
-	IUINT64 ts;
-	IUINT32 now;
 
-	count = ipoll_wait(core->pfd, millisec);
+	if (core->flush.size > 0) {
+		async_core_flush(core);
+		if (core->flush.size > 0) {
+			millisec = 0;	/* some reads yielded: don't block */
+		}
+	}
+
+	if (core->wheel.count > 0) {
+		millisec = async_core_wheel_wait(&core->wheel, iclock(), millisec);
+	}
+
+	count = async_core_poll(core, millisec);
 
-	ts = iclock64();
-	core->current = (IUINT32)(ts & 0xfffffffful);
-	now = (IUINT32)((ts / 1000) & 0xfffffffful);
+	core->stat.polls++;
+	if (count > 0) {
+		core->stat.wakeups++;
+		core->stat.events += count;
+	}
+
+	if (core->flags & ASYNC_CORE_FLAG_HISTOGRAM) {
+		start = iclockrt();
+	}
+
+	core->current = iclock();
 
 	xf = core->xfd[ASYNC_CORE_PIPE_READ];
 
 	for (x = count * 2; x > 0; x--) {
 		CAsyncSock *sock;
 		int needclose = 0;
-		if (ipoll_event(core->pfd, &fd, &event, &udata) != 0) {
-			break;
+		if (index >= fetched) {
+			/* in bulk: no driver call per event */
+			fetched = ipoll_events(core->pfd, results, 
+				(x < ASYNC_CORE_EVENTS)? x : ASYNC_CORE_EVENTS);
+			index = 0;
+			if (fetched <= 0) break;
 		}
+		fd = results[index].fd;
+		event = results[index].event;
+		udata = results[index].udata;
+		index++;
 		if (fd == xf && fd >= 0) {
 			if ((event & IPOLL_IN) || (event & IPOLL_ERR)) {
-				char dummy[10];
 				async_core_monitor++;
-				IMUTEX_LOCK(&core->xmtx);
-			#ifdef __unix
-				read(fd, dummy, 8);
-			#else
-				irecv(fd, dummy, 8, 0);
-			#endif
-				core->xfd[ASYNC_CORE_PIPE_FLAG] = 0;
-				IMUTEX_UNLOCK(&core->xmtx);
+				async_core_drain(core);
 				async_core_monitor--;
 			}
 			continue;
@@ -1795,13 +3469,20 @@ static void async_core_process_events(CAsyncCore *core, IUINT32 millisec)
 		if ((event & IPOLL_IN) || (event & IPOLL_ERR)) {
 			if (sock->mode == ASYNC_CORE_NODE_LISTEN4 ||
 				sock->mode == ASYNC_CORE_NODE_LISTEN6) {
-				async_core_accept(core, sock->hid);
+				long hr;
+				do {	/* edge-triggered: accept until EAGAIN */
+					hr = async_core_accept(core, sock->hid);
+				}	while (core->edge && (hr >= 0 || hr <= -5));
 			}	
 			else {
-				if (async_sock_update(sock, 1) != 0) {
+				int hr = async_sock_update(sock, core->edge? 9 : 1);
+				if (hr < 0) {
 					needclose = 1;
 					code = 0;
 				}
+				else if (hr > 0) {
+					async_core_node_rxmore(core, sock);
+				}
 				if (sock->mode == ASYNC_CORE_NODE_OUT) {
 					if (sock->state == ASYNC_SOCK_STATE_CONNECTING) {
 						if ((event & IPOLL_ERR) && needclose == 0) {
@@ -1812,27 +3493,11 @@ static void async_core_process_events(CAsyncCore *core, IUINT32 millisec)
 				}
 				if (needclose == 0) {
 					async_core_node_active(core, sock->hid);
-				}
-				while (needclose == 0) {
-					long size = async_sock_recv(sock, NULL, 0);
-					if (size < 0) {	/* not enough data or size error */
-						if (size == -3 || size == -4) {	/* size error */
-							needclose = 1;
-							code = (size == -3)? 2001 : 2002;
-						}
-						break;
-					}
-					else if (size > core->bufsize) {	/* buffer resize */
-						if (async_core_buffer_resize(core, size) != 0) {
-							needclose = 1;
-							code = 2003;
-							break;
-						}
+					hr = async_core_node_pump(core, sock);
+					if (hr != 0) {
+						needclose = 1;
+						code = hr;
 					}
-					size = async_sock_recv(sock, core->buffer,
-						core->bufsize);
-					async_core_msg_push(core, ASYNC_CORE_EVT_DATA,
-						sock->hid, sock->tag, core->buffer, size);
 				}
 			}
 		}
@@ -1861,7 +3526,7 @@ static void async_core_process_events(CAsyncCore *core, IUINT32 millisec)
 				}
 			}
 			if (sock->sendmsg.size > 0 && needclose == 0) {
-				if (async_sock_update(sock, 2) != 0) {
+				if (async_core_node_send(core, sock) != 0) {
 					needclose = 1;
 					code = 2005;
 				}
@@ -1881,75 +3546,230 @@ static void async_core_process_events(CAsyncCore *core, IUINT32 millisec)
 		}
 	}
 
-	if (now != core->lastsec && core->timeout > 0) {
-		CAsyncSock *sock;
-		core->lastsec = now;
-		while (!iqueue_is_empty(&core->head)) {
-			IINT32 timeout;
-			sock = iqueue_entry(core->head.next, CAsyncSock, node);
-			timeout = itimediff(core->current, sock->time + core->timeout);
-			if (timeout < 0) break;
-			async_core_event_close(core, sock, 2006);
+	/* after the wakeup is drained: a handoff queued later notifies again */
+	if (core->inbox.size > 0) {
+		async_core_adopt(core);
+	}
+
+	async_core_timer_run(core);
+
+	if (start != 0 && core->hist != NULL) {
+		async_hist_add(&core->hist[ASYNC_CORE_HIST_LOOP], 
+			iclockrt() - start);
+		if (count > 0) {
+			async_hist_add(&core->hist[ASYNC_CORE_HIST_EVENTS], count);
 		}
 	}
 }
 
 
 /*-------------------------------------------------------------------*/
-/* send vector                                                       */
+/* send vector, or the shared buffer after offset if shared is set   */
 /*-------------------------------------------------------------------*/
-static long _async_core_send_vector(CAsyncCore *core, long hid,
-	const void * const vecptr[],
-	const long veclen[], int count, int mask)
+static long _async_core_send_node(CAsyncCore *core, long hid,
+	const void * const vecptr[], const long veclen[], int count, 
+	int mask, struct IMSHARED *shared, long offset)
 {
 	CAsyncSock *sock = async_core_node_get(core, hid);
+	iulong before;
 	long hr;
 	if (sock == NULL) return -100;
 	if (sock->limited > 0 && sock->sendmsg.size > (iulong)sock->limited) {
 		if ((sock->flags & ASYNC_CORE_FLAG_SENSITIVE) == 0) {
-			async_sock_update(sock, 2);
+			async_core_node_send(core, sock);
 		}
 		if (sock->sendmsg.size > (iulong)sock->limited) {
 			async_core_event_close(core, sock, 2007);
 			return -200;
 		}
 	}
-	hr = async_sock_send_vector(sock, vecptr, veclen, count, mask);
+	before = sock->sendmsg.size;
+	if (shared == NULL) {
+		hr = async_sock_send_vector(sock, vecptr, veclen, count, mask);
+	}	else {
+		hr = async_sock_send_shared(sock, shared, offset, mask);
+	}
+	if (sock->hiwater > 0) {
+		async_core_node_water(core, sock);
+	}
+	if (before == 0 && sock->sendmsg.size > 0 && sock->stall > 0) {
+		/* write-stall clock starts when data gets queued */
+		core->current = iclock();
+		sock->wtime = core->current;
+		async_core_node_timer(core, sock);
+	}
 	if (sock->sendmsg.size > 0 && sock->fd >= 0) {
 		if ((sock->mask & IPOLL_OUT) == 0) {
 			async_core_node_mask(core, sock, 
 				IPOLL_OUT, 0);
+			if (core->edge) {
+				/* no IPOLL_OUT edge will come if it is already
+				   writable: flush it before the next poll, so
+				   all sends queued until then share one writev */
+				ims_write(&core->flush, &hid, sizeof(hid));
+			}
+		}
+	}
+	return hr;
+}
+
+/*-------------------------------------------------------------------*/
+/* send vector                                                       */
+/*-------------------------------------------------------------------*/
+static long _async_core_send_vector(CAsyncCore *core, long hid,
+	const void * const vecptr[],
+	const long veclen[], int count, int mask)
+{
+	return _async_core_send_node(core, hid, vecptr, veclen, count, mask,
+		NULL, 0);
+}
+
+/*-------------------------------------------------------------------*/
+/* send vector                                                       */
+/*-------------------------------------------------------------------*/
+long async_core_send_vector(CAsyncCore *core, long hid,
+	const void * const vecptr[],
+	const long veclen[], int count, int mask)
+{
+	long hr = -1;
+	core = async_core_route(core, hid);
+	ASYNC_CORE_CRITICAL_BEGIN(core);
+	hr = _async_core_send_vector(core, hid, vecptr, veclen, count, mask);
+	ASYNC_CORE_CRITICAL_END(core);
+	return hr;
+}
+
+/*-------------------------------------------------------------------*/
+/* send data to given hid                                            */
+/*-------------------------------------------------------------------*/
+long async_core_send(CAsyncCore *core, long hid, const void *ptr, long len)
+{
+	const void *vecptr[1];
+	long veclen[1];
+	long hr;
+	vecptr[0] = ptr;
+	veclen[0] = len;
+	core = async_core_route(core, hid);
+	ASYNC_CORE_CRITICAL_BEGIN(core);
+	hr = _async_core_send_vector(core, hid, vecptr, veclen, 1, 0);
+	ASYNC_CORE_CRITICAL_END(core);
+	return hr;
+}
+
+/*-------------------------------------------------------------------*/
+/* broadcast to hids owned by this reactor, called with it locked    */
+/*-------------------------------------------------------------------*/
+static long _async_core_broadcast(CAsyncCore *core, const long hids[], 
+	int n, const void * const vecptr[], const long veclen[], int count,
+	struct IMSHARED *shared, int *filled)
+{
+	long sent = 0;
+	int i;
+	for (i = 0; i < n; i++) {
+		if (shared != NULL && filled[0] == 0) {
+			/* headroom gets the header of the first receiver, later
+			   ones with the same header link one page per message */
+			CAsyncSock *sock = async_core_node_get(core, hids[i]);
+			if (sock != NULL && sock->encoder == NULL) {
+				char head[ASYNC_SOCK_HEADMAX];
+				long size = (long)shared->size - ASYNC_SOCK_HEADROOM;
+				int hdrlen = async_sock_write_size(sock, size, 0, head);
+				if (hdrlen <= ASYNC_SOCK_HEADROOM) {
+					memcpy(shared->data + ASYNC_SOCK_HEADROOM - hdrlen, 
+						head, hdrlen);
+				}
+				filled[0] = 1;
+			}
 		}
+		if (_async_core_send_node(core, hids[i], vecptr, veclen, 
+			count, 0, shared, ASYNC_SOCK_HEADROOM) >= 0) 
+			sent++;
 	}
-	return hr;
+	return sent;
 }
 
 /*-------------------------------------------------------------------*/
-/* send vector                                                       */
+/* send the same message to many hids                                */
 /*-------------------------------------------------------------------*/
-long async_core_send_vector(CAsyncCore *core, long hid,
-	const void * const vecptr[],
-	const long veclen[], int count, int mask)
+long async_core_broadcast(CAsyncCore *core, const long hids[], int n,
+	const void * const vecptr[], const long veclen[], int count)
 {
-	long hr = -1;
-	ASYNC_CORE_CRITICAL_BEGIN(core);
-	hr = _async_core_send_vector(core, hid, vecptr, veclen, count, mask);
-	ASYNC_CORE_CRITICAL_END(core);
-	return hr;
+	struct IMSHARED *shared = NULL;
+	long sent = 0, size = 0;
+	int i, filled = 0;
+	for (i = 0; i < count; i++) size += veclen[i];
+	if (size >= ASYNC_CORE_SHARE_MIN && n > 1) {
+		/* one copy of the payload, linked into every sendmsg */
+		shared = ims_shared_new(NULL, ASYNC_SOCK_HEADROOM + size, 
+			NULL, NULL);
+		if (shared != NULL) {
+			char *ptr = shared->data + ASYNC_SOCK_HEADROOM;
+			memset(shared->data, 0, ASYNC_SOCK_HEADROOM);
+			for (i = 0; i < count; i++) {
+				memcpy(ptr, vecptr[i], veclen[i]);
+				ptr += veclen[i];
+			}
+		}
+	}
+	if (core->nshards == 0) {
+		ASYNC_CORE_CRITICAL_BEGIN(core);
+		sent = _async_core_broadcast(core, hids, n, vecptr, veclen, count,
+			shared, &filled);
+		ASYNC_CORE_CRITICAL_END(core);
+	}	else if (n > 0) {
+		/* split hids by shard in one pass, then lock each shard once */
+		int start[ASYNC_CORE_SHARD_MAX + 1];
+		long *order = (long*)ikmem_malloc(sizeof(long) * n);
+		memset(start, 0, sizeof(start));
+		if (order == NULL) {
+			for (i = 0; i < n; i++) {
+				CAsyncCore *shard = async_core_route(core, hids[i]);
+				ASYNC_CORE_CRITICAL_BEGIN(shard);
+				sent += _async_core_broadcast(shard, &hids[i], 1, 
+					vecptr, veclen, count, shared, &filled);
+				ASYNC_CORE_CRITICAL_END(shard);
+			}
+		}	else {
+			for (i = 0; i < n; i++) {
+				start[async_core_route(core, hids[i])->shard + 1]++;
+			}
+			for (i = 0; i < core->nshards; i++) {
+				start[i + 1] += start[i];
+			}
+			for (i = 0; i < n; i++) {
+				int id = async_core_route(core, hids[i])->shard;
+				order[start[id]++] = hids[i];
+			}
+			/* start[i] is the end of shard i now */
+			for (i = 0; i < core->nshards; i++) {
+				CAsyncCore *shard = core->shards[i];
+				int from = (i > 0)? start[i - 1] : 0;
+				if (start[i] == from) continue;
+				ASYNC_CORE_CRITICAL_BEGIN(shard);
+				sent += _async_core_broadcast(shard, order + from, 
+					start[i] - from, vecptr, veclen, count, shared, 
+					&filled);
+				ASYNC_CORE_CRITICAL_END(shard);
+			}
+			ikmem_free(order);
+		}
+	}
+	if (shared != NULL) {
+		ims_shared_unref(shared);
+	}
+	return sent;
 }
 
 /*-------------------------------------------------------------------*/
-/* send data to given hid                                            */
+/* send a shared buffer without copying                              */
 /*-------------------------------------------------------------------*/
-long async_core_send(CAsyncCore *core, long hid, const void *ptr, long len)
+long async_core_send_shared(CAsyncCore *core, long hid, 
+	struct IMSHARED *shared, int mask)
 {
-	const void *vecptr[1];
-	long veclen[1];
 	long hr;
-	vecptr[0] = ptr;
-	veclen[0] = len;
+	core = async_core_route(core, hid);
 	ASYNC_CORE_CRITICAL_BEGIN(core);
-	hr = _async_core_send_vector(core, hid, vecptr, veclen, 1, 0);
+	hr = _async_core_send_node(core, hid, NULL, NULL, 0, mask, shared, 0);
 	ASYNC_CORE_CRITICAL_END(core);
 	return hr;
 }
@@ -1959,18 +3779,24 @@ long async_core_send(CAsyncCore *core, long hid, const void *ptr, long len)
 /*-------------------------------------------------------------------*/
 int async_core_close(CAsyncCore *core, long hid, int code)
 {
+	CAsyncCore *master = core;
 	CAsyncSock *sock;
-	int hr = -1;
+	int hr = -1, fanout = 0;
+	core = async_core_route(core, hid);
 	ASYNC_CORE_CRITICAL_BEGIN(core);
 	sock = async_core_node_get(core, hid);
 	if (sock != NULL) {
 		if (sock->sendmsg.size > 0) {
 			async_sock_update(sock, 2);
 		}
+		fanout = (sock->flags & ASYNC_CORE_FLAG_FANOUT)? 1 : 0;
 		async_core_event_close(core, sock, code);
 		hr = 0;
 	}
 	ASYNC_CORE_CRITICAL_END(core);
+	if (fanout && master->nshards > 0) {
+		async_core_close_siblings(master, hid);
+	}
 	return hr;
 }
 
@@ -1992,6 +3818,28 @@ void async_core_wait(CAsyncCore *core, IUINT32 millisec)
 	ASYNC_CORE_CRITICAL_END(core);
 }
 
+/*-------------------------------------------------------------------*/
+/* shard thread: repeatly called until async_core_delete             */
+/*-------------------------------------------------------------------*/
+static int async_core_shard_run(void *obj)
+{
+	CAsyncCore *shard = (CAsyncCore*)obj;
+	if (shard->stop) return 0;
+	IMUTEX_LOCK(&shard->gate);
+	IMUTEX_LOCK(&shard->lock);
+	IMUTEX_UNLOCK(&shard->gate);
+	/* don't block in poll while other threads are queued for the lock */
+	async_core_process_events(shard, 
+		(shard->xwait > 0)? 0 : ASYNC_CORE_SHARD_WAIT);
+	async_core_msg_publish(shard);
+	IMUTEX_UNLOCK(&shard->lock);
+	if (shard->xdirty) {
+		shard->xdirty = 0;
+		async_core_notify(shard->master);
+	}
+	return 1;
+}
+
 /*-------------------------------------------------------------------*/
 /* old interface compatible                                          */
 /*-------------------------------------------------------------------*/
@@ -2005,31 +3853,28 @@ void async_core_process(CAsyncCore *core, IUINT32 millisec)
 /*-------------------------------------------------------------------*/
 int async_core_notify(CAsyncCore *core)
 {
-	int fd;
 	int hr = -1;
+#ifdef ASYNC_CORE_CAS_INT
+	volatile int *flag = &core->xfd[ASYNC_CORE_PIPE_FLAG];
+	/* already signaled and not drained yet: no lock, no syscall */
+	if (flag[0] != 0) return 1;
+	if (ASYNC_CORE_CAS_INT(flag, 0, 1) != 0) return 1;
+	hr = async_core_signal(core);
+	if (hr != 0) {
+		ASYNC_CORE_CAS_INT(flag, 1, 0);
+	}
+#else
 	IMUTEX_LOCK(&core->xmtx);
-	fd = core->xfd[ASYNC_CORE_PIPE_WRITE];
 	if (core->xfd[ASYNC_CORE_PIPE_FLAG] == 0) {
-		if (fd >= 0) {
-			char dummy = 1;
-			int hr = 0;
-		#ifdef __unix
-			#ifndef __AVM2__
-			hr = write(fd, &dummy, 1);
-			#endif
-		#else
-			hr = send(fd, &dummy, 1, 0);
-		#endif
-			if (hr == 1) {
-				core->xfd[ASYNC_CORE_PIPE_FLAG] = 1;
-				hr = 0;
-			}
-			dummy = dummy;
+		hr = async_core_signal(core);
+		if (hr == 0) {
+			core->xfd[ASYNC_CORE_PIPE_FLAG] = 1;
 		}
 	}	else {
 		hr = 1;
 	}
 	IMUTEX_UNLOCK(&core->xmtx);
+#endif
 	return hr;
 }
 
@@ -2044,13 +3889,42 @@ long async_core_read(CAsyncCore *core, int *event, long *wparam,
 }
 
 
+/*-------------------------------------------------------------------*/
+/* read events in batch without copying payloads                     */
+/*-------------------------------------------------------------------*/
+int async_core_read_batch(CAsyncCore *core, CAsyncEvent *events, 
+	int count)
+{
+	return async_core_msg_read_batch(core, events, count);
+}
+
+
 /*-------------------------------------------------------------------*/
 /* push message to msg queue                                         */
 /*-------------------------------------------------------------------*/
 int async_core_push(CAsyncCore *core, int event, long wparam, long lparam, 
 	const char *data, long size)
 {
-	async_core_msg_push(core, event, wparam, lparam, data, size);
+	struct CAsyncBatch *batch;
+	struct CAsyncRecord *record;
+	size = size < 0 ? 0 : size;
+	/* may be called from any thread: publish as a batch of its own */
+	batch = (struct CAsyncBatch*)ikmem_malloc(sizeof(struct CAsyncBatch) +
+		sizeof(struct CAsyncRecord) + ASYNC_CORE_ALIGN(size));
+	if (batch == NULL) return -1;
+	record = (struct CAsyncRecord*)ASYNC_CORE_BATCH_DATA(batch);
+	record->length = size;
+	record->event = event;
+	record->wparam = wparam;
+	record->lparam = lparam;
+	if (size > 0) memcpy(record + 1, data, size);
+	batch->size = (long)sizeof(struct CAsyncRecord) + ASYNC_CORE_ALIGN(size);
+	batch->capacity = batch->size;
+	batch->stamp = 0;
+	if (core->master->flags & ASYNC_CORE_FLAG_HISTOGRAM) {
+		batch->stamp = iclockrt();
+	}
+	async_core_stack_push(core->master, batch);
 	return 0;
 }
 
@@ -2075,6 +3949,7 @@ int async_core_get_mode(const CAsyncCore *core, long hid)
 {
 	const CAsyncSock *sock;
 	int mode = -1;
+	core = async_core_route(core, hid);
 	ASYNC_CORE_CRITICAL_BEGIN(core);
 	sock = async_core_node_get_const(core, hid);
 	if (sock != NULL) mode = sock->mode;
@@ -2087,6 +3962,7 @@ long async_core_get_tag(const CAsyncCore *core, long hid)
 {
 	const CAsyncSock *sock;
 	long tag = -1;
+	core = async_core_route(core, hid);
 	ASYNC_CORE_CRITICAL_BEGIN(core);
 	sock = async_core_node_get_const(core, hid);
 	if (sock != NULL) tag = sock->tag;
@@ -2098,6 +3974,7 @@ long async_core_get_tag(const CAsyncCore *core, long hid)
 void async_core_set_tag(CAsyncCore *core, long hid, long tag)
 {
 	CAsyncSock *sock;
+	core = async_core_route(core, hid);
 	ASYNC_CORE_CRITICAL_BEGIN(core);
 	sock = async_core_node_get(core, hid);
 	if (sock != NULL) {
@@ -2111,6 +3988,7 @@ long async_core_remain(const CAsyncCore *core, long hid)
 {
 	const CAsyncSock *sock;
 	long size = -1;
+	core = async_core_route(core, hid);
 	ASYNC_CORE_CRITICAL_BEGIN(core);
 	sock = async_core_node_get_const(core, hid);
 	if (sock != NULL) size = (long)sock->sendmsg.size;
@@ -2196,11 +4074,67 @@ static int _async_core_option(CAsyncCore *core, long hid,
 	case ASYNC_CORE_OPTION_GETFD:
 		hr = sock->fd;
 		break;
+	case ASYNC_CORE_OPTION_IDLETIMEOUT:
+		sock->idle = (value < 0)? -1 : value;
+		async_core_node_timer(core, sock);
+		hr = 0;
+		break;
+	case ASYNC_CORE_OPTION_CONNTIMEOUT:
+		sock->tmconnect = (value < 0)? 0 : value;
+		async_core_node_timer(core, sock);
+		hr = 0;
+		break;
+	case ASYNC_CORE_OPTION_STALLTIMEOUT:
+		sock->stall = (value < 0)? 0 : value;
+		async_core_node_timer(core, sock);
+		hr = 0;
+		break;
+	case ASYNC_CORE_OPTION_HIGHWATER:
+		sock->hiwater = (value < 0)? 0 : value;
+		if (sock->hiwater == 0) {
+			sock->flags &= ~ASYNC_CORE_FLAG_HIGHWATER;
+		}
+		hr = 0;
+		break;
+	case ASYNC_CORE_OPTION_LOWWATER:
+		sock->lowater = (value < 0)? 0 : value;
+		if (sock->flags & ASYNC_CORE_FLAG_HIGHWATER) {
+			async_core_node_water(core, sock);
+		}
+		hr = 0;
+		break;
+	case ASYNC_CORE_OPTION_TRANSFORM:
+		if (value & 1) async_sock_transform(sock, ASYNC_TRANSFORM_SEND, 0);
+		if (value & 2) async_sock_transform(sock, ASYNC_TRANSFORM_RECV, 0);
+		hr = 0;
+		break;
 	}
 	return hr;
 }
 
 
+/* pick one counter by ASYNC_CORE_STATUS_XXX */
+static long async_core_stat_get(const CAsyncStat *stat, int opt)
+{
+	switch (opt) {
+	case ASYNC_CORE_STATUS_RXBYTES: return (long)stat->rxbytes;
+	case ASYNC_CORE_STATUS_TXBYTES: return (long)stat->txbytes;
+	case ASYNC_CORE_STATUS_RXMSGS: return (long)stat->rxmsgs;
+	case ASYNC_CORE_STATUS_TXMSGS: return (long)stat->txmsgs;
+	case ASYNC_CORE_STATUS_RXCALLS: return (long)stat->rxcalls;
+	case ASYNC_CORE_STATUS_TXCALLS: return (long)stat->txcalls;
+	case ASYNC_CORE_STATUS_RXAGAIN: return (long)stat->rxagain;
+	case ASYNC_CORE_STATUS_TXAGAIN: return (long)stat->txagain;
+	case ASYNC_CORE_STATUS_SENDMAX: return (long)stat->sendmax;
+	case ASYNC_CORE_STATUS_POLLS: return (long)stat->polls;
+	case ASYNC_CORE_STATUS_WAKEUPS: return (long)stat->wakeups;
+	case ASYNC_CORE_STATUS_EVENTS: return (long)stat->events;
+	case ASYNC_CORE_STATUS_SPINS: return (long)stat->spins;
+	case ASYNC_CORE_STATUS_SLEEPS: return (long)stat->sleeps;
+	}
+	return -100;
+}
+
 /* get connection socket status */
 static long _async_core_status(CAsyncCore *core, long hid, int opt)
 {
@@ -2220,6 +4154,19 @@ static long _async_core_status(CAsyncCore *core, long hid, int opt)
 	case ASYNC_CORE_STATUS_ESTAB:
 		hr = inet_tcp_estab(sock->fd);
 		break;
+	case ASYNC_CORE_STATUS_ACCEPTED:
+		hr = sock->accepted;
+		break;
+	case ASYNC_CORE_STATUS_ACCEPTRATE:
+		async_core_accept_tick(core, sock, 0);
+		hr = sock->arate;
+		break;
+	case ASYNC_CORE_STATUS_LISTENER:
+		hr = sock->link;
+		break;
+	default:
+		hr = async_core_stat_get(&sock->stat, opt);
+		break;
 	}
 
 	return hr;
@@ -2229,19 +4176,56 @@ static long _async_core_status(CAsyncCore *core, long hid, int opt)
 int async_core_option(CAsyncCore *core, long hid, int opt, long value)
 {
 	int hr = 0;
+	core = async_core_route(core, hid);
 	ASYNC_CORE_CRITICAL_BEGIN(core);
 	hr = _async_core_option(core, hid, opt, value);
 	ASYNC_CORE_CRITICAL_END(core);
 	return hr;
 }
 
+/* sharded mode: add up the accept counters of fan-out siblings */
+static long async_core_sibling_sum(CAsyncCore *master, long hid, int opt)
+{
+	long total = 0;
+	int i;
+	for (i = 0; i < master->nshards; i++) {
+		CAsyncCore *shard = master->shards[i];
+		struct IQUEUEHEAD *it;
+		ASYNC_CORE_CRITICAL_BEGIN(shard);
+		for (it = shard->listens.next; it != &shard->listens; it = it->next) {
+			CAsyncSock *sock = iqueue_entry(it, CAsyncSock, node);
+			if (sock->link != hid || sock->hid == hid) continue;
+			if (opt == ASYNC_CORE_STATUS_ACCEPTRATE) {
+				async_core_accept_tick(shard, sock, 0);
+				total += sock->arate;
+			}	else {
+				total += sock->accepted;
+			}
+		}
+		ASYNC_CORE_CRITICAL_END(shard);
+	}
+	return total;
+}
+
 /* thread safe */
 long async_core_status(CAsyncCore *core, long hid, int opt)
 {
-	int hr = 0;
+	CAsyncCore *master = core;
+	long hr = 0;
+	if (hid < 0) {
+		CAsyncStat stat;
+		async_core_stat(core, -1, &stat);
+		return async_core_stat_get(&stat, opt);
+	}
+	core = async_core_route(core, hid);
 	ASYNC_CORE_CRITICAL_BEGIN(core);
 	hr = _async_core_status(core, hid, opt);
 	ASYNC_CORE_CRITICAL_END(core);
+	if (hr >= 0 && master->nshards > 0 && 
+		(opt == ASYNC_CORE_STATUS_ACCEPTED || 
+		 opt == ASYNC_CORE_STATUS_ACCEPTRATE)) {
+		hr += async_core_sibling_sum(master, hid, opt);
+	}
 	return hr;
 }
 
@@ -2251,6 +4235,7 @@ int async_core_rc4_set_skey(CAsyncCore *core, long hid,
 {
 	CAsyncSock *sock;
 	int hr = -1;
+	core = async_core_route(core, hid);
 	ASYNC_CORE_CRITICAL_BEGIN(core);
 	sock = async_core_node_get(core, hid);
 	if (sock != NULL) {
@@ -2267,6 +4252,7 @@ int async_core_rc4_set_rkey(CAsyncCore *core, long hid,
 {
 	CAsyncSock *sock;
 	int hr = -1;
+	core = async_core_route(core, hid);
 	ASYNC_CORE_CRITICAL_BEGIN(core);
 	sock = async_core_node_get(core, hid);
 	if (sock != NULL) {
@@ -2277,9 +4263,29 @@ int async_core_rc4_set_rkey(CAsyncCore *core, long hid,
 	return hr;
 }
 
+/* append a transform stage to the send or recv chain of hid */
+int async_core_transform(CAsyncCore *core, long hid, int dir,
+	CAsyncTransform *stage)
+{
+	CAsyncSock *sock;
+	int hr = -1;
+	core = async_core_route(core, hid);
+	ASYNC_CORE_CRITICAL_BEGIN(core);
+	sock = async_core_node_get(core, hid);
+	if (sock != NULL && stage != NULL) {
+		hr = async_sock_transform(sock, dir, stage);
+	}
+	ASYNC_CORE_CRITICAL_END(core);
+	return hr;
+}
+
 /* set default buffer limit and max packet size */
 void async_core_limit(CAsyncCore *core, long limited, long maxsize)
 {
+	int i;
+	for (i = 0; i < core->nshards; i++) {
+		async_core_limit(core->shards[i], limited, maxsize);
+	}
 	ASYNC_CORE_CRITICAL_BEGIN(core);
 	if (limited >= 0) {
 		core->limited = limited;
@@ -2295,6 +4301,7 @@ int async_core_disable(CAsyncCore *core, long hid, int value)
 {
 	CAsyncSock *sock;
 	int hr = -1;
+	core = async_core_route(core, hid);
 	ASYNC_CORE_CRITICAL_BEGIN(core);
 	sock = async_core_node_get(core, hid);
 	if (sock != NULL) {
@@ -2311,17 +4318,43 @@ int async_core_disable(CAsyncCore *core, long hid, int value)
 /* set remote ip validator */
 void async_core_firewall(CAsyncCore *core, CAsyncValidator v, void *user)
 {
+	int i;
+	for (i = 0; i < core->nshards; i++) {
+		async_core_firewall(core->shards[i], v, user);
+	}
 	ASYNC_CORE_CRITICAL_BEGIN(core);
 	core->validator = v;
 	core->user = user;
 	ASYNC_CORE_CRITICAL_END(core);
 }
 
+/* set adaptive spin budget and SO_BUSY_POLL, both in usec */
+void async_core_spin(CAsyncCore *core, long spin, long busypoll)
+{
+	int i;
+	for (i = 0; i < core->nshards; i++) {
+		async_core_spin(core->shards[i], spin, busypoll);
+	}
+	ASYNC_CORE_CRITICAL_BEGIN(core);
+	core->spin = (spin > 0)? spin : 0;
+	core->busypoll = (busypoll > 0)? busypoll : 0;
+	ASYNC_CORE_CRITICAL_END(core);
+}
+
 /* set timeout */
 void async_core_timeout(CAsyncCore *core, long seconds)
 {
+	int i;
+	for (i = 0; i < core->nshards; i++) {
+		async_core_timeout(core->shards[i], seconds);
+	}
 	ASYNC_CORE_CRITICAL_BEGIN(core);
-	core->timeout = seconds * 1000;
+	core->timeout = (seconds > 0)? seconds * 1000 : 0;
+	for (i = imnode_head(core->nodes); i >= 0; 
+		i = imnode_next(core->nodes, i)) {
+		CAsyncSock *sock = (CAsyncSock*)IMNODE_DATA(core->nodes, i);
+		if (sock->idle < 0) async_core_node_timer(core, sock);
+	}
 	ASYNC_CORE_CRITICAL_END(core);
 }
 
@@ -2331,6 +4364,7 @@ int async_core_sockname(const CAsyncCore *core, long hid,
 {
 	const CAsyncSock *sock;
 	int hr = -2;
+	core = async_core_route(core, hid);
 	ASYNC_CORE_CRITICAL_BEGIN(core);
 	sock = async_core_node_get_const(core, hid);
 	if (sock != NULL) hr = isockname(sock->fd, addr, size);
@@ -2344,6 +4378,7 @@ int async_core_peername(const CAsyncCore *core, long hid,
 {
 	const CAsyncSock *sock;
 	int hr = -2;
+	core = async_core_route(core, hid);
 	ASYNC_CORE_CRITICAL_BEGIN(core);
 	sock = async_core_node_get_const(core, hid);
 	if (sock != NULL) hr = ipeername(sock->fd, addr, size);
@@ -2351,12 +4386,148 @@ int async_core_peername(const CAsyncCore *core, long hid,
 	return hr;
 }
 
+/* sum the aggregates of core and shards, every sock counter is also */
+/* added to core->stat when it changes, so no node is visited here   */
+static void async_core_stat_sum(const CAsyncCore *core, CAsyncStat *stat)
+{
+	CAsyncStat snapshot;
+	long i;
+	for (i = 0; i < core->nshards; i++) {
+		async_core_stat_sum(core->shards[i], stat);
+	}
+	ASYNC_CORE_CRITICAL_BEGIN(core);
+	snapshot = core->stat;
+	ASYNC_CORE_CRITICAL_END(core);
+	async_core_stat_add(stat, &snapshot);
+}
+
+/* copy traffic counters of hid, or of the whole core if hid < 0 */
+int async_core_stat(const CAsyncCore *core, long hid, CAsyncStat *stat)
+{
+	const CAsyncSock *sock;
+	int hr = -1;
+	if (hid < 0) {
+		memset(stat, 0, sizeof(CAsyncStat));
+		async_core_stat_sum(core, stat);
+		return 0;
+	}
+	core = async_core_route(core, hid);
+	ASYNC_CORE_CRITICAL_BEGIN(core);
+	sock = async_core_node_get_const(core, hid);
+	if (sock != NULL) {
+		stat[0] = sock->stat;
+		hr = 0;
+	}
+	ASYNC_CORE_CRITICAL_END(core);
+	return hr;
+}
+
+/* histograms: 1 enable, 0 disable, 2 clear */
+int async_core_histogram(CAsyncCore *core, int mode)
+{
+	long size = (long)sizeof(struct CAsyncHist) * ASYNC_CORE_HIST_COUNT;
+	int hr = 0, i;
+	for (i = 0; i < core->nshards; i++) {
+		if (async_core_histogram(core->shards[i], mode) != 0) hr = -1;
+	}
+	ASYNC_CORE_CRITICAL_BEGIN(core);
+	if (mode != 0 && core->hist == NULL) {
+		/* kept until async_core_delete, the reader uses it unlocked */
+		core->hist = (struct CAsyncHist*)ikmem_malloc(size);
+		if (core->hist != NULL) memset(core->hist, 0, size);
+	}
+	if (core->hist == NULL) {
+		if (mode != 0) hr = -1;
+	}
+	else if (mode == 2) {
+		if (core->nolock == 0) IMUTEX_LOCK(&core->xmsg);
+		memset(core->hist, 0, size);
+		if (core->nolock == 0) IMUTEX_UNLOCK(&core->xmsg);
+	}
+	else if (mode == 1) {
+		core->flags |= ASYNC_CORE_FLAG_HISTOGRAM;
+	}
+	else {
+		core->flags &= ~ASYNC_CORE_FLAG_HISTOGRAM;
+	}
+	ASYNC_CORE_CRITICAL_END(core);
+	return hr;
+}
+
+/* merge histogram which of core and shards */
+static void async_core_hist_sum(CAsyncCore *core, int which, 
+	struct CAsyncHist *hist)
+{
+	int i;
+	for (i = 0; i < core->nshards; i++) {
+		async_core_hist_sum(core->shards[i], which, hist);
+	}
+	ASYNC_CORE_CRITICAL_BEGIN(core);
+	if (core->nolock == 0) IMUTEX_LOCK(&core->xmsg);
+	if (core->hist != NULL) {
+		async_hist_merge(hist, &core->hist[which]);
+	}
+	if (core->nolock == 0) IMUTEX_UNLOCK(&core->xmsg);
+	ASYNC_CORE_CRITICAL_END(core);
+}
+
+/* append text like snprintf, returns the new position */
+static long async_core_hist_text(char *out, long size, long pos, 
+	const char *text)
+{
+	long length = (long)strlen(text);
+	if (out != NULL && pos + 1 < size) {
+		long canwrite = size - 1 - pos;
+		if (canwrite > length) canwrite = length;
+		memcpy(out + pos, text, canwrite);
+		out[pos + canwrite] = 0;
+	}
+	return pos + length;
+}
+
+/* dump histogram as text */
+long async_core_histogram_dump(CAsyncCore *core, int which, 
+	char *out, long size)
+{
+	struct CAsyncHist *hist;
+	char line[200];
+	long pos = 0;
+	int i;
+	if (which < 0 || which >= ASYNC_CORE_HIST_COUNT) return -1;
+	hist = (struct CAsyncHist*)ikmem_malloc(sizeof(struct CAsyncHist));
+	if (hist == NULL) return -1;
+	memset(hist, 0, sizeof(struct CAsyncHist));
+	async_core_hist_sum(core, which, hist);
+	if (out != NULL && size > 0) out[0] = 0;
+	sprintf(line, "count=%ld mean=%ld max=%ld p50=%ld p90=%ld p99=%ld "
+		"p999=%ld\n", (long)hist->count, 
+		(long)((hist->count > 0)? hist->total / hist->count : 0),
+		(long)hist->max,
+		(long)async_hist_percentile(hist, 500),
+		(long)async_hist_percentile(hist, 900),
+		(long)async_hist_percentile(hist, 990),
+		(long)async_hist_percentile(hist, 999));
+	pos = async_core_hist_text(out, size, pos, line);
+	for (i = 0; i < ASYNC_HIST_BUCKETS; i++) {
+		if (hist->bucket[i] == 0) continue;
+		sprintf(line, "le=%ld count=%lu\n", (long)async_hist_upper(i),
+			(unsigned long)hist->bucket[i]);
+		pos = async_core_hist_text(out, size, pos, line);
+	}
+	ikmem_free(hist);
+	return pos;
+}
+
 /* get fd count */
 long async_core_nfds(const CAsyncCore *core)
 {
 	long count = 0;
+	int i;
+	for (i = 0; i < core->nshards; i++) {
+		count += async_core_nfds(core->shards[i]);
+	}
 	ASYNC_CORE_CRITICAL_BEGIN(core);
-	count = core->count;
+	count += core->count;
 	ASYNC_CORE_CRITICAL_END(core);
 	return count;
 }
@@ -2365,12 +4536,29 @@ long async_core_nfds(const CAsyncCore *core)
 /*===================================================================*/
 /* Thread Safe Queue                                                 */
 /*===================================================================*/
+struct iQueueCell
+{
+	volatile size_t seq;
+	void *data;
+};
+
 struct iQueueSafe
 {
 	iPosixSemaphore *sem;
 	struct IMSTREAM stream;
 	int stop;
 	IMUTEX_TYPE lock;
+	struct iQueueCell *cells;
+	size_t mask;
+	iConditionVariable *cond_not_full;
+	iConditionVariable *cond_not_empty;
+	volatile int putters;
+	volatile int getters;
+	char pad1[64];
+	volatile size_t tail;
+	char pad2[64];
+	volatile size_t head;
+	char pad3[64];
 };
 
 
@@ -2386,17 +4574,64 @@ iQueueSafe *queue_safe_new(iulong maxsize)
 		return NULL;
 	}
 	q->stop = 0;
+	q->cells = NULL;
+	q->mask = 0;
+	q->cond_not_full = NULL;
+	q->cond_not_empty = NULL;
+	q->putters = 0;
+	q->getters = 0;
+	q->tail = 0;
+	q->head = 0;
 	ims_init(&q->stream, NULL, 4096, 4096);
 	IMUTEX_INIT(&q->lock);
 	return q;
 }
 
+/* new lock-free bounded queue, capacity is rounded up to power of 2 */
+/* and at least 2, a single cell can't tell "full" from "free" apart */
+iQueueSafe *queue_safe_new_ring(iulong capacity)
+{
+#ifdef ASYNC_CORE_CAS
+	iQueueSafe *q;
+	size_t size = 2, i;
+	if (capacity == 0) return NULL;
+	for (; size < (size_t)capacity; size <<= 1) {
+		if (size >= (((size_t)1) << (sizeof(size_t) * 8 - 2))) return NULL;
+	}
+	q = queue_safe_new(0);
+	if (q == NULL) return NULL;
+	q->cells = (struct iQueueCell*)
+		ikmem_malloc(sizeof(struct iQueueCell) * size);
+	q->cond_not_full = iposix_cond_new();
+	q->cond_not_empty = iposix_cond_new();
+	if (q->cells == NULL || q->cond_not_full == NULL || 
+		q->cond_not_empty == NULL) {
+		queue_safe_delete(q);
+		return NULL;
+	}
+	for (i = 0; i < size; i++) {
+		q->cells[i].seq = i;
+		q->cells[i].data = NULL;
+	}
+	q->mask = size - 1;
+	return q;
+#else
+	return queue_safe_new(capacity);
+#endif
+}
+
 /* delete queue */
 void queue_safe_delete(iQueueSafe *q) 
 {
 	if (q) {
 		if (q->sem) iposix_sem_delete(q->sem);
+		if (q->cells) ikmem_free(q->cells);
+		if (q->cond_not_full) iposix_cond_delete(q->cond_not_full);
+		if (q->cond_not_empty) iposix_cond_delete(q->cond_not_empty);
 		q->sem = NULL;
+		q->cells = NULL;
+		q->cond_not_full = NULL;
+		q->cond_not_empty = NULL;
 		q->stop = 1;
 		ims_destroy(&q->stream);
 		IMUTEX_DESTROY(&q->lock);
@@ -2448,6 +4683,183 @@ void queue_safe_hook_peek(iulong count, void *p)
 	}
 }
 
+/*-------------------------------------------------------------------*/
+/* lock-free ring: each cell has a sequence number (Vyukov), a batch */
+/* claims several consecutive cells with one CAS on head or tail     */
+/*-------------------------------------------------------------------*/
+#ifdef ASYNC_CORE_CAS
+
+#if defined(__GNUC__) && defined(__ATOMIC_ACQUIRE)
+#define ASYNC_QUEUE_BARRIER() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define ASYNC_QUEUE_ACQUIRE() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define ASYNC_QUEUE_RELEASE() __atomic_thread_fence(__ATOMIC_RELEASE)
+#elif defined(__GNUC__)
+#define ASYNC_QUEUE_BARRIER() __sync_synchronize()
+#define ASYNC_QUEUE_ACQUIRE() __sync_synchronize()
+#define ASYNC_QUEUE_RELEASE() __sync_synchronize()
+#else
+#define ASYNC_QUEUE_BARRIER() MemoryBarrier()
+#define ASYNC_QUEUE_ACQUIRE() MemoryBarrier()
+#define ASYNC_QUEUE_RELEASE() MemoryBarrier()
+#endif
+
+#define ASYNC_QUEUE_PUT		0
+#define ASYNC_QUEUE_GET		1
+#define ASYNC_QUEUE_PEEK	2
+
+/* try to put, returns how many entered, 0 for full */
+static size_t queue_ring_put(iQueueSafe *q, const void * const vecptr[],
+	size_t count)
+{
+	struct iQueueCell *cells = q->cells;
+	size_t mask = q->mask;
+	size_t pos, seq, n, i;
+	while (1) {
+		pos = q->tail;
+		for (n = 0; n < count; n++) {
+			seq = cells[(pos + n) & mask].seq;
+			if (seq != pos + n) break;
+		}
+		if (n == 0) {
+			seq = cells[pos & mask].seq;
+			if ((ptrdiff_t)(seq - pos) < 0) return 0;
+			continue;
+		}
+		if ((size_t)ASYNC_CORE_CAS(&q->tail, pos, pos + n) != pos) 
+			continue;
+		for (i = 0; i < n; i++) {
+			cells[(pos + i) & mask].data = (void*)vecptr[i];
+		}
+		ASYNC_QUEUE_RELEASE();
+		for (i = 0; i < n; i++) {
+			cells[(pos + i) & mask].seq = pos + i + 1;
+		}
+		return n;
+	}
+}
+
+/* try to get or peek, returns how many fetched, 0 for empty */
+static size_t queue_ring_get(iQueueSafe *q, void *vecptr[], 
+	size_t count, int peek)
+{
+	struct iQueueCell *cells = q->cells;
+	size_t mask = q->mask;
+	size_t pos, seq, n, i;
+	while (1) {
+		pos = q->head;
+		for (n = 0; n < count; n++) {
+			seq = cells[(pos + n) & mask].seq;
+			if (seq != pos + n + 1) break;
+		}
+		if (n == 0) {
+			seq = cells[pos & mask].seq;
+			if ((ptrdiff_t)(seq - (pos + 1)) < 0) return 0;
+			continue;
+		}
+		ASYNC_QUEUE_ACQUIRE();
+		if (peek) {
+			for (i = 0; i < n; i++) {
+				vecptr[i] = cells[(pos + i) & mask].data;
+			}
+			ASYNC_QUEUE_ACQUIRE();
+			if (q->head != pos) continue;
+			return n;
+		}
+		if ((size_t)ASYNC_CORE_CAS(&q->head, pos, pos + n) != pos)
+			continue;
+		for (i = 0; i < n; i++) {
+			vecptr[i] = cells[(pos + i) & mask].data;
+		}
+		ASYNC_QUEUE_RELEASE();
+		for (i = 0; i < n; i++) {
+			cells[(pos + i) & mask].seq = pos + i + mask + 1;
+		}
+		return n;
+	}
+}
+
+/* wake up the other side if anyone is sleeping, the flag is set by  */
+/* every sleeper before its last try and cleared by the broadcast    */
+static void queue_ring_wake(iQueueSafe *q, int mode)
+{
+	ASYNC_QUEUE_BARRIER();
+	if (mode == ASYNC_QUEUE_PUT && q->getters) {
+		IMUTEX_LOCK(&q->lock);
+		q->getters = 0;
+		iposix_cond_wake_all(q->cond_not_empty);
+		IMUTEX_UNLOCK(&q->lock);
+	}
+	else if (mode == ASYNC_QUEUE_GET && q->putters) {
+		IMUTEX_LOCK(&q->lock);
+		q->putters = 0;
+		iposix_cond_wake_all(q->cond_not_full);
+		IMUTEX_UNLOCK(&q->lock);
+	}
+}
+
+/* one lock-free attempt of put/get/peek */
+static size_t queue_ring_try(iQueueSafe *q, int mode, void *vecptr[],
+	int count)
+{
+	if (mode == ASYNC_QUEUE_PUT) {
+		return queue_ring_put(q, (const void * const *)vecptr, 
+			(size_t)count);
+	}
+	return queue_ring_get(q, vecptr, (size_t)count, 
+		(mode == ASYNC_QUEUE_PEEK)? 1 : 0);
+}
+
+/* lock-free attempt first, sleep only when empty or full */
+static int queue_ring_vec(iQueueSafe *q, int mode, void *vecptr[],
+	int count, unsigned long millisec)
+{
+	iConditionVariable *cond;
+	volatile int *waiters;
+	size_t hr;
+
+	hr = queue_ring_try(q, mode, vecptr, count);
+
+	if (hr == 0 && millisec != 0) {
+		if (mode == ASYNC_QUEUE_PUT) {
+			cond = q->cond_not_full;
+			waiters = &q->putters;
+		}	else {
+			cond = q->cond_not_empty;
+			waiters = &q->getters;
+		}
+		IMUTEX_LOCK(&q->lock);
+		while (q->stop == 0) {
+			*waiters = 1;
+			ASYNC_QUEUE_BARRIER();
+			hr = queue_ring_try(q, mode, vecptr, count);
+			if (hr > 0) break;
+			if (millisec != IEVENT_INFINITE) {
+				IUINT32 ts = iclock();
+				IUINT32 last = millisec > 10000? 10000 : (IUINT32)millisec;
+				iposix_cond_sleep_cs_time(cond, &q->lock, last);
+				last = iclock() - ts;
+				if (millisec <= (unsigned long)last) {
+					hr = queue_ring_try(q, mode, vecptr, count);
+					break;
+				}	else {
+					millisec -= (unsigned long)last;
+				}
+			}	else {
+				iposix_cond_sleep_cs(cond, &q->lock);
+			}
+		}
+		IMUTEX_UNLOCK(&q->lock);
+	}
+
+	if (hr > 0) {
+		queue_ring_wake(q, mode);
+	}
+
+	return (int)hr;
+}
+
+#endif
+
 /* put many objs into queue, returns how many obj have entered the queue */
 int queue_safe_put_vec(iQueueSafe *q, const void * const vecptr[], 
 	int count, unsigned long millisec)
@@ -2455,6 +4867,12 @@ int queue_safe_put_vec(iQueueSafe *q, const void * const vecptr[],
 	struct iQueueSafeArg args;
 	int hr;
 	if (q->stop || count <= 0) return 0;
+#ifdef ASYNC_CORE_CAS
+	if (q->cells) {
+		return queue_ring_vec(q, ASYNC_QUEUE_PUT, (void**)vecptr, 
+			count, millisec);
+	}
+#endif
 	args.q = q;
 	args.in = (const void*)vecptr;
 	hr = (int)iposix_sem_post(q->sem, count, millisec, 
@@ -2469,6 +4887,11 @@ int queue_safe_get_vec(iQueueSafe *q, void *vecptr[], int count,
 	struct iQueueSafeArg args;
 	int hr;
 	if (q->stop || count <= 0) return 0;
+#ifdef ASYNC_CORE_CAS
+	if (q->cells) {
+		return queue_ring_vec(q, ASYNC_QUEUE_GET, vecptr, count, millisec);
+	}
+#endif
 	args.q = q;
 	args.out = (void*)vecptr;
 	hr = (int)iposix_sem_wait(q->sem, count, millisec, 
@@ -2483,6 +4906,11 @@ int queue_safe_peek_vec(iQueueSafe *q, void *vecptr[], int count,
 	struct iQueueSafeArg args;
 	int hr;
 	if (q->stop || count <= 0) return 0;
+#ifdef ASYNC_CORE_CAS
+	if (q->cells) {
+		return queue_ring_vec(q, ASYNC_QUEUE_PEEK, vecptr, count, millisec);
+	}
+#endif
 	args.q = q;
 	args.out = (void*)vecptr;
 	hr = (int)iposix_sem_peek(q->sem, count, millisec, 
@@ -2520,6 +4948,12 @@ int queue_safe_peek(iQueueSafe *q, void **ptr, unsigned long millisec)
 /* get size */
 iulong queue_safe_size(iQueueSafe *q)
 {
+	if (q->cells) {
+		size_t head = q->head;
+		size_t tail = q->tail;
+		if ((ptrdiff_t)(tail - head) <= 0) return 0;
+		return (iulong)(tail - head);
+	}
 	return iposix_sem_value(q->sem);
 }
 
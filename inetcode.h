@@ -49,6 +49,53 @@ int inet_updateaddr(int resolvname);
 int inet_socketpair(int fds[2]);
 
 
+/*===================================================================*/
+/* CAsyncTransform                                                   */
+/*===================================================================*/
+
+/* one stage of a per-connection stream transform chain (cipher, 
+ * checksum...): process() maps size bytes from src to dst keeping the
+ * length, src and dst may be the same page span. stages run in the 
+ * order they are added, release() is called when the socket drops it */
+struct CAsyncTransform
+{
+	struct CAsyncTransform *next;
+	void (*process)(struct CAsyncTransform *self, const void *src, 
+		void *dst, long size);
+	void (*release)(struct CAsyncTransform *self);
+	void *user;
+};
+
+typedef struct CAsyncTransform CAsyncTransform;
+
+#define ASYNC_TRANSFORM_SEND		0
+#define ASYNC_TRANSFORM_RECV		1
+
+
+/*===================================================================*/
+/* CAsyncStat                                                        */
+/*===================================================================*/
+struct CAsyncStat
+{
+	IINT64 rxbytes;					/* bytes received from the socket */
+	IINT64 txbytes;					/* bytes sent to the socket */
+	IINT64 rxmsgs;					/* messages delivered */
+	IINT64 txmsgs;					/* messages queued */
+	IINT64 rxcalls;					/* recv syscalls */
+	IINT64 txcalls;					/* send syscalls */
+	IINT64 rxagain;					/* recv returned EAGAIN */
+	IINT64 txagain;					/* send returned EAGAIN */
+	IINT64 sendmax;					/* peak send queue size in bytes */
+	IINT64 polls;					/* core only: poll calls */
+	IINT64 wakeups;					/* core only: polls returned events */
+	IINT64 events;					/* core only: events returned */
+	IINT64 spins;					/* core only: non-blocking spin polls */
+	IINT64 sleeps;					/* core only: blocking polls */
+};
+
+typedef struct CAsyncStat CAsyncStat;
+
+
 /*===================================================================*/
 /* CAsyncSock                                                        */
 /*===================================================================*/
@@ -65,21 +112,31 @@ struct CAsyncSock
 	int mode;						/* socket mode */
 	int ipv6;						/* 0:ipv4, 1:ipv6 */
 	int flags;						/* flag bits */
+	long link;						/* listener hid */
+	long accepted;					/* listener: total accepted */
+	long arate;						/* listener: accepts per second */
+	long acount;					/* listener: accepts in window */
+	IUINT32 astamp;					/* listener: window start */
+	IUINT32 expires;				/* timing wheel: deadline */
+	IUINT32 wtime;					/* last send progress */
+	long idle;						/* idle timeout (ms), <0 default */
+	long tmconnect;					/* connect timeout (ms) */
+	long stall;						/* write-stall timeout (ms) */
+	long hiwater;					/* send queue high watermark */
+	long lowater;					/* send queue low watermark */
 	char *buffer;					/* internal working buffer */
 	char *external;					/* external working buffer */
 	long bufsize;					/* working buffer size */
 	long maxsize;					/* max packet size */
 	long limited;					/* buffer limited */
-	int rc4_send_x;					/* rc4 encryption variable */
-	int rc4_send_y;					/* rc4 encryption variable */
-	int rc4_recv_x;					/* rc4 encryption variable */
-	int rc4_recv_y;					/* rc4 encryption variable */
+	CAsyncTransform *encoder;		/* send transform chain */
+	CAsyncTransform *decoder;		/* recv transform chain */
+	struct IMSTREAM *linemsg;		/* line buffer, allocated on demand */
+	struct CAsyncStat stat;			/* traffic counters */
+	struct CAsyncStat *total;		/* core aggregate fed too, or NULL */
 	struct IQUEUEHEAD node;			/* list node */
-	struct IMSTREAM linemsg;		/* line buffer */
 	struct IMSTREAM sendmsg;		/* send buffer */
 	struct IMSTREAM recvmsg;		/* recv buffer */
-	unsigned char rc4_send_box[256];	
-	unsigned char rc4_recv_box[256];
 };
 
 
@@ -99,6 +156,7 @@ struct CAsyncSock
 #define ITMH_DWORDMASK		12		/* header: 4 bytes LSB (self and mask) */
 #define ITMH_RAWDATA		13		/* header: raw data */
 #define ITMH_LINESPLIT		14		/* header: '\n' split */
+#define ITMH_VARINT			15		/* header: varint size (exclude self) */
 #endif
 
 #define ASYNC_SOCK_STATE_CLOSED			0
@@ -153,6 +211,11 @@ long async_sock_send_vector(CAsyncSock *asyncsock,
 	const void * const vecptr[],
 	const long veclen[], int count, int mask);
 
+/* send shared buffer after offset by reference, the header is linked
+ * from the headroom before offset when it matches, otherwise copied */
+long async_sock_send_shared(CAsyncSock *asyncsock, struct IMSHARED *shared,
+	long offset, int mask);
+
 /**
  * recv vector: returns packet size, -1 for not enough data, -2 for 
  * buffer size too small, -3 for packet size error, -4 for size over limit,
@@ -162,13 +225,21 @@ long async_sock_recv_vector(CAsyncSock *asyncsock, void* const vecptr[],
 	const long veclen[], int count);
 
 
-/* update */
+/* update: (what & 1) recv, (what & 2) send, (what & 4) connect, 
+ * (what & 8) keep receiving until EAGAIN (edge-triggered), at most
+ * ASYNC_SOCK_DRAIN reads: returns 1 if more data may be pending,
+ * returns 0 for ok and below zero for error */
 int async_sock_update(CAsyncSock *asyncsock, int what);
 
 /* process */
 void async_sock_process(CAsyncSock *asyncsock);
 
 
+/* append a stage to the send or recv chain (ASYNC_TRANSFORM_SEND/RECV),
+ * NULL stage releases the whole chain */
+int async_sock_transform(CAsyncSock *asyncsock, int dir, 
+	CAsyncTransform *stage);
+
 /* set send cryption key */
 void async_sock_rc4_set_skey(CAsyncSock *asyncsock, 
 	const unsigned char *key, int keylen);
@@ -194,12 +265,26 @@ int async_sock_keepalive(CAsyncSock *asyncsock, int keepcnt, int keepidle,
 struct CAsyncCore;
 typedef struct CAsyncCore CAsyncCore;
 
+/* event descriptor filled by async_core_read_batch */
+struct CAsyncEvent
+{
+	int event;
+	long wparam;
+	long lparam;
+	const char *ptr;
+	long len;
+};
+
+typedef struct CAsyncEvent CAsyncEvent;
+
 #define ASYNC_CORE_EVT_NEW		0	/* new: (hid, tag)   */
 #define ASYNC_CORE_EVT_LEAVE	1	/* leave: (hid, tag) */
 #define ASYNC_CORE_EVT_ESTAB	2	/* estab: (hid, tag) */
 #define ASYNC_CORE_EVT_DATA		3	/* data: (hid, tag)  */
 #define ASYNC_CORE_EVT_PROGRESS	4	/* output progress: (hid, tag) */
 #define ASYNC_CORE_EVT_PUSH		5	/* msg from async_core_push */
+#define ASYNC_CORE_EVT_HIGHWATER	6	/* send queue over high: (hid, tag) */
+#define ASYNC_CORE_EVT_LOWWATER	7	/* send queue back to low: (hid, tag) */
 
 #define ASYNC_CORE_NODE_IN			1		/* accepted node */
 #define ASYNC_CORE_NODE_OUT			2		/* connected out node */
@@ -214,7 +299,12 @@ typedef int (*CAsyncValidator)(const struct sockaddr *remote, int len,
 
 /**
  * create CAsyncCore object:
- * if (flags & 1) disable lock, if (flags & 2) disable notify
+ * if (flags & 1) disable lock, if (flags & 2) disable notify,
+ * if (flags & 4) use edge-triggered polling when the device supports it,
+ * if ((flags >> 8) & 0xff) is greater than 1, creates that many reactor 
+ * shards, each polls in its own thread, connections are distributed 
+ * round-robin and events are still read from the returned core.
+ * at most 16 shards, 65535 connections are shared among them.
  */
 CAsyncCore* async_core_new(int flags);
 
@@ -234,11 +324,20 @@ int async_core_notify(CAsyncCore *core);
 /**
  * read events, returns data length of the message, 
  * and returns -1 for no event, -2 for buffer size too small,
- * returns data size when data equals NULL.
+ * returns data size when data equals NULL. events are queued without
+ * locks and become readable once the producing call returns.
  */
 long async_core_read(CAsyncCore *core, int *event, long *wparam,
 	long *lparam, void *data, long size);
 
+/**
+ * read up to count events at once without copying, returns how many
+ * events are filled. payloads point into memory owned by the core and
+ * stay valid until the next async_core_read/async_core_read_batch.
+ */
+int async_core_read_batch(CAsyncCore *core, CAsyncEvent *events, 
+	int count);
+
 
 /* send data to given hid */
 long async_core_send(CAsyncCore *core, long hid, const void *ptr, long len);
@@ -251,11 +350,26 @@ long async_core_send_vector(CAsyncCore *core, long hid,
 	const void * const vecptr[],
 	const long veclen[], int count, int mask);
 
+/* send the same vector to n hids, locking each reactor once,
+ * returns how many hids the message is queued to */
+long async_core_broadcast(CAsyncCore *core, const long hids[], int n,
+	const void * const vecptr[], const long veclen[], int count);
+
+/* send a refcounted buffer without copying it, the reference taken is
+ * dropped once the bytes leave the send queue */
+long async_core_send_shared(CAsyncCore *core, long hid, 
+	struct IMSHARED *shared, int mask);
+
 
 /* new connection to the target address, returns hid */
 long async_core_new_connect(CAsyncCore *core, const struct sockaddr *addr,
 	int addrlen, int header);
 
+/* header flag for async_core_new_listen: opens one SO_REUSEPORT listener
+ * per shard and lets the kernel balance accepts among them, if any of
+ * them fails, the whole listener is closed and the error is returned */
+#define ASYNC_CORE_LISTEN_FANOUT	0x10000
+
 /* new listener, returns hid */
 long async_core_new_listen(CAsyncCore *core, const struct sockaddr *addr, 
 	int addrlen, int header);
@@ -309,6 +423,17 @@ long async_core_node_prev(const CAsyncCore *core, long hid);
 #define ASYNC_CORE_OPTION_REUSEPORT		10
 #define ASYNC_CORE_OPTION_UNIXREUSE		11
 #define ASYNC_CORE_OPTION_SENSITIVE		12
+#define ASYNC_CORE_OPTION_IDLETIMEOUT	13	/* ms, 0 off, <0 async_core_timeout */
+#define ASYNC_CORE_OPTION_CONNTIMEOUT	14	/* ms, 0 off */
+#define ASYNC_CORE_OPTION_STALLTIMEOUT	15	/* ms, 0 off */
+#define ASYNC_CORE_OPTION_HIGHWATER		16	/* bytes, 0 off */
+#define ASYNC_CORE_OPTION_LOWWATER		17	/* bytes */
+#define ASYNC_CORE_OPTION_TRANSFORM		18	/* release chains: 1 send, 2 recv */
+
+/* close codes in ASYNC_CORE_EVT_LEAVE of the timeouts above */
+#define ASYNC_CORE_CODE_IDLE			2006
+#define ASYNC_CORE_CODE_CONNECT			2008
+#define ASYNC_CORE_CODE_STALL			2009
 
 /* set connection socket option */
 int async_core_option(CAsyncCore *core, long hid, int opt, long value);
@@ -316,10 +441,53 @@ int async_core_option(CAsyncCore *core, long hid, int opt, long value);
 #define ASYNC_CORE_STATUS_STATE		0
 #define ASYNC_CORE_STATUS_IPV6		1
 #define ASYNC_CORE_STATUS_ESTAB		2
-
-/* get connection socket status */
+#define ASYNC_CORE_STATUS_ACCEPTED	3	/* listener: total accepted */
+#define ASYNC_CORE_STATUS_ACCEPTRATE	4	/* listener: accepts per second */
+#define ASYNC_CORE_STATUS_LISTENER	5	/* listener hid of the node */
+#define ASYNC_CORE_STATUS_RXBYTES	6	/* counters, see CAsyncStat */
+#define ASYNC_CORE_STATUS_TXBYTES	7
+#define ASYNC_CORE_STATUS_RXMSGS	8
+#define ASYNC_CORE_STATUS_TXMSGS	9
+#define ASYNC_CORE_STATUS_RXCALLS	10
+#define ASYNC_CORE_STATUS_TXCALLS	11
+#define ASYNC_CORE_STATUS_RXAGAIN	12
+#define ASYNC_CORE_STATUS_TXAGAIN	13
+#define ASYNC_CORE_STATUS_SENDMAX	14
+#define ASYNC_CORE_STATUS_POLLS		15	/* core only (hid < 0) */
+#define ASYNC_CORE_STATUS_WAKEUPS	16	/* core only (hid < 0) */
+#define ASYNC_CORE_STATUS_EVENTS	17	/* core only (hid < 0) */
+#define ASYNC_CORE_STATUS_SPINS		18	/* core only (hid < 0) */
+#define ASYNC_CORE_STATUS_SLEEPS	19	/* core only (hid < 0) */
+
+/* get connection socket status, hid < 0 reads the counters of the 
+ * whole core (all shards, closed connections included). the 64 bit
+ * counters are truncated to long, which is 32 bits on Win64 (LLP64),
+ * so RXBYTES/TXBYTES wrap after 2 GB there: use async_core_stat */
 long async_core_status(CAsyncCore *core, long hid, int opt);
 
+/* copy traffic counters of hid, or of the whole core if hid < 0, 
+ * returns 0 for success, -1 if hid does not exist */
+int async_core_stat(const CAsyncCore *core, long hid, CAsyncStat *stat);
+
+#define ASYNC_CORE_HIST_LOOP		0	/* usec spent per poll wakeup */
+#define ASYNC_CORE_HIST_EVENTS		1	/* events returned per wakeup */
+#define ASYNC_CORE_HIST_QUEUE		2	/* usec from enqueue to read */
+
+/* histograms: 1 enable, 0 disable, 2 clear, applied to all shards,
+ * returns 0 for success, -1 for out of memory */
+int async_core_histogram(CAsyncCore *core, int mode);
+
+/* dump histogram ASYNC_CORE_HIST_XXX as text: one summary line with
+ * percentiles, then "le=<upper> count=<n>" per non-empty bucket, returns
+ * the full text length (like snprintf) or -1 for invalid which */
+long async_core_histogram_dump(CAsyncCore *core, int which, 
+	char *out, long size);
+
+/* append a transform stage to the send or recv chain of hid, returns 0
+ * when the socket takes the stage over, see ASYNC_CORE_OPTION_TRANSFORM */
+int async_core_transform(CAsyncCore *core, long hid, int dir,
+	CAsyncTransform *stage);
+
 /* set connection rc4 send key */
 int async_core_rc4_set_skey(CAsyncCore *core, long hid, 
 	const unsigned char *key, int keylen);
@@ -331,9 +499,14 @@ int async_core_rc4_set_rkey(CAsyncCore *core, long hid,
 /* set remote ip validator */
 void async_core_firewall(CAsyncCore *core, CAsyncValidator v, void *user);
 
-/* set timeout */
+/* set default idle timeout of all connections, 0 to disable */
 void async_core_timeout(CAsyncCore *core, long seconds);
 
+/* adaptive spin: poll without blocking for up to spin usec before a
+ * blocking wait, busypoll > 0 sets SO_BUSY_POLL (usec) on sockets
+ * connected or accepted later, 0 disables both (default) */
+void async_core_spin(CAsyncCore *core, long spin, long busypoll);
+
 /* getsockname */
 int async_core_sockname(const CAsyncCore *core, long hid, 
 	struct sockaddr *addr, int *size);
@@ -355,6 +528,10 @@ typedef struct iQueueSafe iQueueSafe;
 /* new queue */
 iQueueSafe *queue_safe_new(iulong maxsize);
 
+/* new lock-free bounded queue (capacity rounded up to power of 2, >= 2), 
+ * the same put/get api, blocks only when it is empty or full */
+iQueueSafe *queue_safe_new_ring(iulong capacity);
+
 /* delete queue */
 void queue_safe_delete(iQueueSafe *q);
 
@@ -349,17 +349,25 @@ int ihttpsock_block_getch(IHTTPSOCK *httpsock)
 // returns IHTTPSOCK_BLOCK_CLOSED for connection shutdown or error
 int ihttpsock_block_gets(IHTTPSOCK *httpsock, ivalue_t *text)
 {
-	unsigned char str[2];
 	assert(httpsock);
 	while (1) {
-		int ch = ihttpsock_block_getch(httpsock);
-		if (ch == IHTTPSOCK_BLOCK_AGAIN) return IHTTPSOCK_BLOCK_AGAIN;
-		if (ch == IHTTPSOCK_BLOCK_CLOSED) break;
-		str[0] = (unsigned char)ch;
-		str[1] = 0;
-		it_strcatc(text, (char*)str, 1);
-		if (ch == '\n') return IHTTPSOCK_BLOCK_DONE;
+		ilong pos = ims_findc(&httpsock->recvmsg, '\n');
+		ilong size = (pos >= 0)? pos + 1 : ims_dsize(&httpsock->recvmsg);
+		if (size > 0) {
+			// move the whole line (or what arrived of it) at once
+			iulong savesize = it_size(text);
+			it_sresize(text, savesize + size);
+			ims_read(&httpsock->recvmsg, it_str(text) + savesize, size);
+			httpsock->received += size;
+			if (pos >= 0) return IHTTPSOCK_BLOCK_DONE;
+		}
+		ihttpsock_try_recv(httpsock);
+		if (ims_dsize(&httpsock->recvmsg) == 0) break;
 	}
+	if (httpsock->state == IHTTPSOCK_STATE_CONNECTED) 
+		return IHTTPSOCK_BLOCK_AGAIN;
+	if (httpsock->state == IHTTPSOCK_STATE_CONNECTING) 
+		return IHTTPSOCK_BLOCK_AGAIN;
 	return IHTTPSOCK_BLOCK_CLOSED;
 }
 
@@ -98,7 +98,8 @@ void console_clear(int color)
 //=====================================================================
 struct iCsvReader
 {
-	istring_list_t *source;
+	ivalue_t *source;
+	ilong offset;
 	istring_list_t *strings;
 #ifndef IDISABLE_FILE_SYSTEM_ACCESS
 	FILE *fp;
@@ -136,6 +137,7 @@ iCsvReader *icsv_reader_open_file(const char *filename)
 	it_init(&reader->string, ITYPE_STR);
 	reader->fp = fp;
 	reader->source = NULL;
+	reader->offset = 0;
 	reader->strings = NULL;
 	reader->line = 0;
 	reader->count = 0;
@@ -159,16 +161,22 @@ iCsvReader *icsv_reader_open_memory(const char *text, ilong size)
 	reader->fp = NULL;
 #endif
 	reader->source = NULL;
+	reader->offset = 0;
 	reader->strings = NULL;
 	reader->line = 0;
 	reader->count = 0;
 
-	reader->source = istring_list_split(text, size, "\n", 1);
+	// rows are split lazily by icsv_reader_read
+	reader->source = (ivalue_t*)ikmem_malloc(sizeof(ivalue_t));
 	if (reader->source == NULL) {
+		it_destroy(&reader->string);
 		ikmem_free(reader);
 		return NULL;
 	}
 
+	it_init(reader->source, ITYPE_STR);
+	it_strcpyc(reader->source, text, size);
+
 	return reader;
 }
 
@@ -180,7 +188,8 @@ void icsv_reader_close(iCsvReader *reader)
 			reader->strings = NULL;
 		}
 		if (reader->source) {
-			istring_list_delete(reader->source);
+			it_destroy(reader->source);
+			ikmem_free(reader->source);
 			reader->source = NULL;
 		}
 #ifndef IDISABLE_FILE_SYSTEM_ACCESS
@@ -222,15 +231,25 @@ int icsv_reader_read(iCsvReader *reader)
 	}
 	reader->count = 0;
 	if (reader->source) {	// ʹıģʽ
-		ivalue_t *str;
-		if (reader->line >= reader->source->count) {
-			istring_list_delete(reader->source);
+		ilong size = (ilong)it_size(reader->source) - reader->offset;
+		const char *text = it_str(reader->source) + reader->offset;
+		ilong ends[1];
+		if (size < 0) {
+			it_destroy(reader->source);
+			ikmem_free(reader->source);
 			reader->source = NULL;
 			return -1;
 		}
-		str = reader->source->values[reader->line++];
-		it_strstripc(str, "\r\n");
-		icsv_reader_parse(reader, str);
+		if (istrlines(text, size, ends, 1) == 0) {
+			ends[0] = size + 1;	/* last row, without '\n' */
+			it_strcpyc(&reader->string, text, size);
+		}	else {
+			it_strcpyc(&reader->string, text, ends[0]);
+		}
+		reader->offset += ends[0];
+		reader->line++;
+		it_strstripc(&reader->string, "\r\n");
+		icsv_reader_parse(reader, &reader->string);
 	}
 #ifndef IDISABLE_FILE_SYSTEM_ACCESS
 	else if (reader->fp) {
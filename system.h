@@ -1292,8 +1292,11 @@ protected:
 class Queue
 {
 public:
-	Queue(iulong maxsize = 0) {
-		_queue = queue_safe_new(maxsize);
+	// maxsize Ϊ 0 ʱ޴Сlockfree Ϊ true ʱʹζУ
+	// ʱ maxsize  0ȡ 2 
+	Queue(iulong maxsize = 0, bool lockfree = false) {
+		if (lockfree) _queue = queue_safe_new_ring(maxsize);
+		else _queue = queue_safe_new(maxsize);
 		if (_queue == NULL) 
 			SYSTEM_THROW("can not create Queue", 10008);
 	}
@@ -1833,7 +1836,25 @@ struct TaskInt
 
 
 //---------------------------------------------------------------------
-// ̳߳
+// ԭӲTaskPool ύջջʹ
+//---------------------------------------------------------------------
+#if defined(__GNUC__) && (!defined(SYSTEM_NO_ATOMIC))
+#define SYSTEM_CAS_PTR(ptr, oldval, newval) \
+	__sync_val_compare_and_swap(ptr, oldval, newval)
+#define SYSTEM_ATOMIC_ADD(ptr, value) \
+	__sync_add_and_fetch(ptr, value)
+#elif defined(_WIN32) && (!defined(SYSTEM_NO_ATOMIC))
+#define SYSTEM_CAS_PTR(ptr, oldval, newval) \
+	InterlockedCompareExchangePointer((PVOID volatile*)(ptr), \
+		(PVOID)(newval), (PVOID)(oldval))
+#define SYSTEM_ATOMIC_ADD(ptr, value) \
+	((long)InterlockedExchangeAdd((LONG volatile*)(ptr), \
+		(LONG)(value)) + (long)(value))
+#endif
+
+
+//---------------------------------------------------------------------
+// ̳߳أÿ߳һУʱ߳ȡ
 //---------------------------------------------------------------------
 class TaskPool
 {
@@ -1845,7 +1866,21 @@ public:
 		if (nthreads < 1) {
 			SYSTEM_THROW("nthreads must great than zero", 10009);
 		}
+		_submit = NULL;
+		_finish = NULL;
+		_pending = 0;
+		_idle = 0;
+		_workers.resize(nthreads);
 		_threads.resize(nthreads);
+		for (int i = 0; i < nthreads; i++) {
+			TaskQueue *worker = new TaskQueue;
+			worker->pool = this;
+			worker->index = i;
+			worker->head = NULL;
+			worker->tail = NULL;
+			worker->count = 0;
+			_workers[i] = worker;
+		}
 		for (int i = 0; i < nthreads; i++) {
 			std::string text = name;
 			char buf[64];
@@ -1853,7 +1888,7 @@ public:
 			text += "(";
 			text += buf;
 			text += ")";
-			_threads[i] = new Thread(__thread_entry, this, text.c_str());
+			_threads[i] = new Thread(__thread_entry, _workers[i], text.c_str());
 			if (_threads[i] == NULL) {
 				SYSTEM_THROW("can not create thread for TaskPool", 10012);
 			}
@@ -1866,26 +1901,19 @@ public:
 
 	// ̳߳زɾδɵ
 	virtual ~TaskPool() {
-		TaskNode *node;
-		void *obj;
+		TaskNode *last;
+		long count;
 		stop();
 		for (int i = 0; i < _nthreads; i++) {
 			delete _threads[i];
 			_threads[i] = NULL;
 		}
-		while (1) {
-			if (_queue_out.get(&obj, 0) == 0) break;
-			node = (TaskNode*)obj;
-			delete node->task;
-			node->task = NULL;
-			delete node;
-		}
-		while (1) {
-			if (_queue_in.get(&obj, 0) == 0) break;
-			node = (TaskNode*)obj;
-			delete node->task;
-			node->task = NULL;
-			delete node;
+		__node_free(__stack_take(&_finish, &last, &count));
+		__node_free(__stack_take(&_submit, &last, &count));
+		for (int i = 0; i < _nthreads; i++) {
+			__node_free(_workers[i]->head);
+			delete _workers[i];
+			_workers[i] = NULL;
 		}
 	}
 
@@ -1907,28 +1935,38 @@ public:
 		_stop = true;
 		for (int i = 0; i < _nthreads; i++) {
 			_threads[i]->set_notalive();
+		}
+		_cond.enter();
+		_cond.wake(true);
+		_cond.leave();
+		for (int i = 0; i < _nthreads; i++) {
 			_threads[i]->join();
 		}
 		_start = false;
 	}
 
-	// 
+	// ѹύջ߳ʱȥ
 	inline bool push(TaskInt *task) {
 		if (_stop) return false;
 		TaskNode *node = new TaskNode;
 		node->task = task;
-		if (_queue_in.put(node, 0) == 0) return false;
+		node->ok = false;
+		__atomic_add(&_pending, 1);
+		__stack_push(&_submit, node, node);
+		if (_idle > 0) __wake();
 		return true;
 	}
 
 	// £̴߳Ľ done/error/finalѭ
+	// صɵȺ˳У֤ push˳
 	inline void update() {
 		while (1) {
-			void *objs[64];
-			int hr = _queue_out.get_many(objs, 64, 0);
-			if (hr == 0) break;
-			for (int i = 0; i < hr; i++) {
-				TaskNode *node = (TaskNode*)objs[i];
+			TaskNode *last;
+			long count;
+			TaskNode *node = __stack_take(&_finish, &last, &count);
+			if (node == NULL) break;
+			while (node) {
+				TaskNode *next = node->next;
 				TaskInt *task = node->task;
 				if (node->ok) {
 					try { task->done(); }
@@ -1942,16 +1980,15 @@ public:
 				delete node->task;
 				node->task = NULL;
 				delete node;
+				node = next;
 			}
+			__atomic_add(&_pending, -count);
 		}
 	}
 
-	// ȡδִɵ
+	// ȡδִɵִк͵ȴ updateģ
 	inline int size() {
-		int x1, x2;
-		x1 = (int)_queue_in.size();
-		x2 = (int)_queue_out.size();
-		return x1 + x2;
+		return (int)_pending;
 	}
 
 	// ȴ
@@ -1963,50 +2000,198 @@ public:
 	}
 
 protected:
-	struct TaskNode { TaskInt *task; bool ok; };
+	struct TaskNode { TaskInt *task; bool ok; TaskNode *next; };
+
+	// Уͷȡ̺߳ȡ߹һ
+	struct TaskQueue {
+		TaskPool *pool;
+		int index;
+		CriticalSection lock;
+		TaskNode *head;
+		TaskNode *tail;
+		volatile long count;
+	};
+
+	// Ƚϲûԭָʱ˻ɻ
+	inline TaskNode *__cas(TaskNode * volatile *ptr, TaskNode *oldval, TaskNode *newval) {
+	#ifdef SYSTEM_CAS_PTR
+		return (TaskNode*)SYSTEM_CAS_PTR(ptr, oldval, newval);
+	#else
+		CriticalScope scope(_atomic);
+		TaskNode *current = *ptr;
+		if (current == oldval) *ptr = newval;
+		return current;
+	#endif
+	}
+
+	// ԭӼӷֵ
+	inline long __atomic_add(volatile long *ptr, long value) {
+	#ifdef SYSTEM_ATOMIC_ADD
+		return SYSTEM_ATOMIC_ADD(ptr, value);
+	#else
+		CriticalScope scope(_atomic);
+		*ptr += value;
+		return *ptr;
+	#endif
+	}
+
+	// ѹһѾӺõĽڵ first -> ... -> last
+	inline void __stack_push(TaskNode * volatile *stack, TaskNode *first, TaskNode *last) {
+		while (1) {
+			TaskNode *head = *stack;
+			last->next = head;
+			if (__cas(stack, head, first) == head) break;
+		}
+	}
+
+	// һȡջתȽȳ˳
+	inline TaskNode *__stack_take(TaskNode * volatile *stack, TaskNode **last, long *count) {
+		TaskNode *head = *stack;
+		TaskNode *list = NULL;
+		*last = NULL;
+		*count = 0;
+		while (head != NULL) {
+			TaskNode *current = __cas(stack, head, NULL);
+			if (current == head) break;
+			head = current;
+		}
+		if (head == NULL) return NULL;
+		*last = head;
+		while (head) {
+			TaskNode *next = head->next;
+			head->next = list;
+			list = head;
+			head = next;
+			(*count)++;
+		}
+		return list;
+	}
+
+	// ׷ӵβ
+	inline void __queue_push(TaskQueue *queue, TaskNode *first, TaskNode *last, long count) {
+		CriticalScope scope(queue->lock);
+		last->next = NULL;
+		if (queue->tail) queue->tail->next = first;
+		else queue->head = first;
+		queue->tail = last;
+		queue->count += count;
+	}
+
+	// ӹͷȡ limit ڵ
+	inline TaskNode *__queue_pop(TaskQueue *queue, long limit, TaskNode **last, long *count) {
+		CriticalScope scope(queue->lock);
+		TaskNode *first = queue->head;
+		TaskNode *node = first;
+		long n = 1;
+		*count = 0;
+		if (first == NULL) return NULL;
+		for (; n < limit && node->next; n++) node = node->next;
+		queue->head = node->next;
+		if (queue->head == NULL) queue->tail = NULL;
+		queue->count -= n;
+		node->next = NULL;
+		*last = node;
+		*count = n;
+		return first;
+	}
+
+	// ͷһڵ㼰
+	inline void __node_free(TaskNode *node) {
+		while (node) {
+			TaskNode *next = node->next;
+			delete node->task;
+			node->task = NULL;
+			delete node;
+			node = next;
+		}
+	}
+
+	// һߵ߳
+	inline void __wake() {
+		_cond.enter();
+		_cond.wake();
+		_cond.leave();
+	}
+
+	// ȡһ񣺱ضУύջ߳ȡһ
+	inline TaskNode *__fetch(TaskQueue *local) {
+		TaskNode *node, *last;
+		long count;
+		node = __queue_pop(local, 1, &last, &count);
+		if (node) return node;
+		node = __stack_take(&_submit, &last, &count);
+		for (int i = 1; node == NULL && i < _nthreads; i++) {
+			TaskQueue *victim = _workers[(local->index + i) % _nthreads];
+			if (victim->count <= 0) continue;
+			node = __queue_pop(victim, (victim->count + 1) / 2, &last, &count);
+		}
+		if (node == NULL) return NULL;
+		if (count > 1) {
+			__queue_push(local, node->next, last, count - 1);
+			node->next = NULL;
+			if (_idle > 0) __wake();
+		}
+		return node;
+	}
+
+	// Ƿȡ
+	inline bool __has_work() {
+		if (_submit != NULL) return true;
+		for (int i = 0; i < _nthreads; i++) {
+			if (_workers[i]->count > 0) return true;
+		}
+		return false;
+	}
 
 	// һ
 	inline void __task_invoke(TaskNode *node) {
 		node->ok = true;
 		try { node->task->run(); }
 		catch (...) { node->ok = false; }
-		_queue_out.put(node, IEVENT_INFINITE);
+		__stack_push(&_finish, node, node);
 	}
 
 	// ̵߳ε
-	inline int __run() {
+	inline int __run(TaskQueue *local) {
+		int count = 0;
 		if (_stop) return 0;
-		if (_nthreads > 1) {
-			void *obj;
-			int hr = _queue_in.get(&obj, (IUINT32)_slap);
-			if (hr == 0) return 1;
-			__task_invoke((TaskNode*)obj);
-		}	else {
-			void *objs[16];
-			int hr = _queue_in.get_many(objs, 16, (IUINT32)_slap);
-			if (hr == 0) return 1;
-			for (int i = 0; i < hr; i++) {
-				__task_invoke((TaskNode*)objs[i]);
-			}
+		for (; count < 64; count++) {
+			TaskNode *node = __fetch(local);
+			if (node == NULL) break;
+			__task_invoke(node);
+			if (_stop) return 0;
+		}
+		if (count > 0) return 1;
+		_cond.enter();
+		__atomic_add(&_idle, 1);
+		if (_stop == false && __has_work() == false) {
+			_cond.sleep((unsigned long)_slap);
 		}
+		__atomic_add(&_idle, -1);
+		_cond.leave();
 		return 1;
 	}
 
 	// ̬߳̾
 	static int __thread_entry(void *p) {
-		TaskPool *self = (TaskPool*)p;
-		int hr = self->__run();
+		TaskQueue *local = (TaskQueue*)p;
+		int hr = local->pool->__run(local);
 		return hr;
 	}
 
 protected:
-	bool _stop;
+	volatile bool _stop;
 	bool _start;
 	int _nthreads;
 	int _slap;
-	Queue _queue_in;
-	Queue _queue_out;
+	TaskNode * volatile _submit;
+	TaskNode * volatile _finish;
+	volatile long _pending;
+	volatile long _idle;
+	ConditionLock _cond;
+	CriticalSection _atomic;
 	std::string _name;
+	std::vector<TaskQueue*> _workers;
 	std::vector<Thread*> _threads;
 };
 